@@ -0,0 +1,64 @@
+#include "poacc.h"
+
+// bump pointerのアリーナアロケータ
+//
+// オブジェクトはブロックの中から順に切り出すだけで個別には解放しない.
+// 返すメモリは0で初期化されている.
+
+// 1ブロックの大きさ
+int arena_block_size = 1024 * 1024;
+
+struct ArenaBlock {
+  ArenaBlock *next;
+  char data[];
+};
+
+Arena token_arena = {"tokens"};
+Arena ast_arena = {"ast"};
+Arena type_arena = {"types"};
+Arena string_arena = {"strings"};
+
+void *arena_alloc(Arena *arena, int size) {
+  size = align_to(size, 8);
+
+  if (arena->end - arena->ptr < size) {
+    int len = size > arena_block_size ? size : arena_block_size;
+    ArenaBlock *blk = calloc(1, sizeof(ArenaBlock) + len);
+    if (!blk)
+      error("%s: out of memory", arena->name);
+    blk->next = arena->blocks;
+    arena->blocks = blk;
+    arena->ptr = blk->data;
+    arena->end = blk->data + len;
+  }
+
+  void *p = arena->ptr;
+  arena->ptr += size;
+  arena->bytes += size;
+  arena->objects++;
+  return p;
+}
+
+// アリーナのメモリをまとめて解放する. 統計はそのまま残す.
+void arena_free(Arena *arena) {
+  ArenaBlock *blk = arena->blocks;
+  while (blk) {
+    ArenaBlock *next = blk->next;
+    free(blk);
+    blk = next;
+  }
+  arena->blocks = NULL;
+  arena->ptr = arena->end = NULL;
+  arena->freed = true;
+}
+
+void print_arena_stats() {
+  Arena *arenas[] = {&token_arena, &ast_arena, &type_arena, &string_arena};
+
+  fprintf(stderr, "%-16s %12s %10s\n", "arena", "bytes", "objects");
+  for (int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++) {
+    Arena *arena = arenas[i];
+    fprintf(stderr, "%-16s %12ld %10ld%s\n", arena->name, arena->bytes,
+            arena->objects, arena->freed ? " (freed)" : "");
+  }
+}
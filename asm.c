@@ -0,0 +1,294 @@
+#include "poacc.h"
+
+char *regname64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                     "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+char *regname32[] = {"eax",  "ecx",  "edx",  "ebx",  "esp",  "ebp",
+                     "esi",  "edi",  "r8d",  "r9d",  "r10d", "r11d",
+                     "r12d", "r13d", "r14d", "r15d"};
+char *regname8[] = {"al",   "cl",   "dl",   "bl",   "spl",  "bpl",
+                    "sil",  "dil",  "r8b",  "r9b",  "r10b", "r11b",
+                    "r12b", "r13b", "r14b", "r15b"};
+
+char *mnemonic[] = {
+    [INSN_MOV] = "mov",   [INSN_MOVSX] = "movsx", [INSN_MOVZX] = "movzx",
+    [INSN_LEA] = "lea",   [INSN_PUSH] = "push",   [INSN_POP] = "pop",
+    [INSN_ADD] = "add",   [INSN_SUB] = "sub",     [INSN_IMUL] = "imul",
+    [INSN_CQO] = "cqo",   [INSN_IDIV] = "idiv",   [INSN_NEG] = "neg",
+    [INSN_SHL] = "shl",   [INSN_SAR] = "sar",     [INSN_SHR] = "shr",
+    [INSN_AND] = "and",
+    [INSN_CMP] = "cmp",   [INSN_SETCC] = "set",   [INSN_JMP] = "jmp",
+    [INSN_JCC] = "j",     [INSN_CALL] = "call",   [INSN_RET] = "ret",
+};
+
+char *ccname[] = {"e", "ne", "l", "le", "g", "ge"};
+
+// 出力する命令列. 先頭はダミーのラベル
+Insn head = {INSN_LABEL};
+Insn *insns = &head;
+Insn *cursor = &head;
+
+Operand reg_op(Reg r) {
+  Operand op = {OPND_REG, 8};
+  op.reg = r;
+  return op;
+}
+
+Operand reg8_op(Reg r) {
+  Operand op = {OPND_REG, 1};
+  op.reg = r;
+  return op;
+}
+
+// 大きさ`size`で読み書きするときのレジスタ`r`
+Operand sized_reg_op(Reg r, int size) {
+  Operand op = {OPND_REG, size};
+  op.reg = r;
+  return op;
+}
+
+Operand imm_op(long val) {
+  Operand op = {OPND_IMM, 8};
+  op.val = val;
+  return op;
+}
+
+Operand mem_op(Reg base, int disp, int size) {
+  Operand op = {OPND_MEM, size};
+  op.reg = base;
+  op.disp = disp;
+  return op;
+}
+
+Operand index_op(Reg base, Reg index, int scale, int disp, int size) {
+  Operand op = mem_op(base, disp, size);
+  op.index = index;
+  op.scale = scale;
+  return op;
+}
+
+Operand sym_op(char *name) {
+  Operand op = {OPND_SYM, 8};
+  op.sym = name;
+  return op;
+}
+
+bool same_op(Operand a, Operand b) {
+  if (a.kind != b.kind || a.size != b.size)
+    return false;
+
+  switch (a.kind) {
+  case OPND_NONE:
+    return true;
+  case OPND_REG:
+    return a.reg == b.reg;
+  case OPND_IMM:
+    return a.val == b.val;
+  case OPND_MEM:
+    return a.reg == b.reg && a.disp == b.disp && a.scale == b.scale &&
+           (!a.scale || a.index == b.index);
+  case OPND_SYM:
+    return !strcmp(a.sym, b.sym) && a.disp == b.disp;
+  }
+  return false;
+}
+
+// 新しい命令をcursorの直後に挿入し, cursorを進める
+Insn *new_insn(InsnKind kind) {
+  Insn *insn = calloc(1, sizeof(Insn));
+  insn->kind = kind;
+  insn->prev = cursor;
+  insn->next = cursor->next;
+  if (cursor->next)
+    cursor->next->prev = insn;
+  cursor->next = insn;
+  cursor = insn;
+  return insn;
+}
+
+Insn *emit0(InsnKind kind) { return new_insn(kind); }
+
+Insn *emit1(InsnKind kind, Operand dst) {
+  Insn *insn = new_insn(kind);
+  insn->dst = dst;
+  return insn;
+}
+
+Insn *emit2(InsnKind kind, Operand dst, Operand src) {
+  Insn *insn = new_insn(kind);
+  insn->dst = dst;
+  insn->src = src;
+  return insn;
+}
+
+Insn *emit_label(char *label) {
+  Insn *insn = new_insn(INSN_LABEL);
+  insn->label = label;
+  return insn;
+}
+
+Insn *emit_jmp(char *label) {
+  Insn *insn = new_insn(INSN_JMP);
+  insn->label = label;
+  return insn;
+}
+
+Insn *emit_jcc(CondCode cc, char *label) {
+  Insn *insn = new_insn(INSN_JCC);
+  insn->cc = cc;
+  insn->label = label;
+  return insn;
+}
+
+Insn *emit_setcc(CondCode cc, Reg r) {
+  Insn *insn = emit1(INSN_SETCC, reg8_op(r));
+  insn->cc = cc;
+  return insn;
+}
+
+Insn *emit_call(char *name) {
+  Insn *insn = new_insn(INSN_CALL);
+  insn->label = name;
+  return insn;
+}
+
+void delete_insn(Insn *insn) {
+  assert(insn != &head);
+  if (cursor == insn)
+    cursor = insn->prev;
+  insn->prev->next = insn->next;
+  if (insn->next)
+    insn->next->prev = insn->prev;
+}
+
+CondCode negate_cc(CondCode cc) {
+  switch (cc) {
+  case CC_E:
+    return CC_NE;
+  case CC_NE:
+    return CC_E;
+  case CC_L:
+    return CC_GE;
+  case CC_LE:
+    return CC_G;
+  case CC_G:
+    return CC_LE;
+  default:
+    assert(cc == CC_GE);
+    return CC_L;
+  }
+}
+
+char *ptr_name(int size) {
+  switch (size) {
+  case 1:
+    return "byte ptr ";
+  case 2:
+    return "word ptr ";
+  case 4:
+    return "dword ptr ";
+  default:
+    return "qword ptr ";
+  }
+}
+
+void print_op(Operand op, bool with_size) {
+  switch (op.kind) {
+  case OPND_REG:
+    if (op.size == 1)
+      out_str(regname8[op.reg]);
+    else if (op.size == 4)
+      out_str(regname32[op.reg]);
+    else
+      out_str(regname64[op.reg]);
+    return;
+  case OPND_IMM:
+    out_int(op.val);
+    return;
+  case OPND_MEM:
+    if (with_size)
+      out_str(ptr_name(op.size));
+    out_char('[');
+    out_str(regname64[op.reg]);
+    if (op.scale) {
+      out_char('+');
+      out_str(regname64[op.index]);
+      out_char('*');
+      out_int(op.scale);
+    }
+    if (op.disp > 0)
+      out_char('+');
+    if (op.disp)
+      out_int(op.disp);
+    out_char(']');
+    return;
+  case OPND_SYM:
+    if (with_size)
+      out_str(ptr_name(op.size));
+    out_str("[rip+");
+    out_str(op.sym);
+    if (op.disp > 0)
+      out_char('+');
+    if (op.disp)
+      out_int(op.disp);
+    out_char(']');
+    return;
+  }
+}
+
+void print_insn(Insn *insn) {
+  switch (insn->kind) {
+  case INSN_LABEL:
+    out_str(insn->label);
+    out_str(":\n");
+    return;
+  case INSN_JMP:
+  case INSN_CALL:
+    out_str("    ");
+    out_str(mnemonic[insn->kind]);
+    out_char(' ');
+    out_str(insn->label);
+    out_char('\n');
+    return;
+  case INSN_JCC:
+    out_str("    j");
+    out_str(ccname[insn->cc]);
+    out_char(' ');
+    out_str(insn->label);
+    out_char('\n');
+    return;
+  case INSN_SETCC:
+    out_str("    set");
+    out_str(ccname[insn->cc]);
+    out_char(' ');
+    print_op(insn->dst, false);
+    out_char('\n');
+    return;
+  }
+
+  out_str("    ");
+  out_str(mnemonic[insn->kind]);
+  // 32ビットからの符号拡張はmovsxd
+  if (insn->kind == INSN_MOVSX && insn->src.size == 4)
+    out_char('d');
+  if (insn->dst.kind == OPND_NONE) {
+    out_char('\n');
+    return;
+  }
+
+  // メモリオペランドの大きさがもう一方のオペランドから決まらなければ
+  // `byte ptr`などを付ける
+  out_char(' ');
+  print_op(insn->dst, insn->src.kind != OPND_REG);
+  if (insn->src.kind != OPND_NONE) {
+    out_str(", ");
+    print_op(insn->src,
+             insn->kind == INSN_MOVSX || insn->kind == INSN_MOVZX);
+  }
+  out_char('\n');
+}
+
+void print_insns(Insn *insn) {
+  for (; insn; insn = insn->next)
+    if (insn != &head)
+      print_insn(insn);
+}
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Measures the tokenizer on a generated multi-megabyte input that is
+# mostly keywords, identifiers and punctuators.
+
+TIMEFORMAT=%R
+input=tmp-lex.c
+
+# About 4 MiB of code.
+awk 'BEGIN {
+  for (i = 0; i < 20000; i++) {
+    printf "int func_%d(int x, char *buf) {\n", i
+    printf "  int count_%d = 0;\n", i
+    printf "  for (int i = 0; i <= x; i = i + 1) {\n"
+    printf "    if (buf[i] != 0 && count_%d >= sizeof(x)) count_%d = count_%d + i;\n", i, i, i
+    printf "    else while (x == 1) return count_%d;\n", i
+    printf "  }\n  return count_%d;\n}\n", i
+  }
+}' > "$input"
+
+size=$(wc -c < "$input")
+./poacc --tokenize-only "$input" || exit 1
+
+best=
+for i in 1 2 3 4 5; do
+  t=$( { time ./poacc --tokenize-only "$input"; } 2>&1 )
+  if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+    best=$t
+  fi
+done
+
+awk -v size="$size" -v t="$best" \
+  'BEGIN { printf "tokenize %.1f MiB: %ss (%.1f MiB/s)\n", size / 1048576, t, size / 1048576 / t }'
+
+rm -f "$input"
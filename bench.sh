@@ -0,0 +1,45 @@
+#!/bin/bash
+#
+# Compares the run time of the programs in bench/ compiled with the
+# register allocator (default) and with the push/pop stack machine
+# (-fno-regalloc).
+
+TIMEFORMAT=%R
+
+# Prints the best of three wall-clock times of running ./tmp-bench.
+run() {
+  local best=
+  for i in 1 2 3; do
+    local t
+    t=$( { time ./tmp-bench > /dev/null; } 2>&1 )
+    if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+      best=$t
+    fi
+  done
+  echo "$best"
+}
+
+# Compiles `file` with the given flags and prints its run time.
+bench() {
+  local file="$1"
+  shift
+  ./poacc "$@" "$file" > tmp-bench.s || exit 1
+  gcc -static -o tmp-bench tmp-bench.s || exit 1
+  ./tmp-bench
+  local status="$?"
+  if [ "$status" != 0 ]; then
+    echo "$file $*: exited with $status" >&2
+    exit 1
+  fi
+  run
+}
+
+printf "%-16s %10s %10s %8s\n" benchmark stack regalloc speedup
+for file in bench/*.c; do
+  stack=$(bench "$file" -fno-regalloc) || exit 1
+  reg=$(bench "$file") || exit 1
+  awk -v name="$(basename "$file" .c)" -v stack="$stack" -v reg="$reg" \
+    'BEGIN { printf "%-16s %10s %10s %7.2fx\n", name, stack, reg, stack / reg }'
+done
+
+rm -f tmp-bench tmp-bench.s
@@ -0,0 +1,12 @@
+int main() {
+  int a = 1;
+  int b = 2;
+  int c = 3;
+  int s = 0;
+  int i;
+  for (i = 0; i < 50000000; i = i + 1) {
+    s = s + (a * b + c * (i - a * (b - c))) / (c + b * (a + 1));
+    s = s - (s / 1024) * 1024;
+  }
+  return s - s;
+}
@@ -0,0 +1,8 @@
+int fib(int x) {
+  if (x <= 1)
+    return 1;
+  return fib(x - 1) + fib(x - 2);
+}
+int main() {
+  return fib(35) - 14930352;
+}
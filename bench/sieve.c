@@ -0,0 +1,23 @@
+int flags[1000000];
+int sieve(int n) {
+  int count = 0;
+  int i;
+  int j;
+  for (i = 0; i < n; i = i + 1)
+    flags[i] = 1;
+  for (i = 2; i < n; i = i + 1) {
+    if (flags[i]) {
+      count = count + 1;
+      for (j = i + i; j < n; j = j + i)
+        flags[j] = 0;
+    }
+  }
+  return count;
+}
+int main() {
+  int k;
+  int count;
+  for (k = 0; k < 30; k = k + 1)
+    count = sieve(1000000);
+  return count - 78498;
+}
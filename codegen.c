@@ -2,23 +2,122 @@
 
 void gen(Node *node);
 
-char *argreg1[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
-char *argreg8[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+Reg argreg[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// 式の一時値を置くレジスタ
+//
+// 式の評価中の一時値は木構造に沿って入れ子の生存区間を持つので,
+// linear scan はスタック規律の割り当てに帰着する. `top`番目の一時値は
+// tmpreg[top]に置き, 足りなくなった分はハードウェアスタックにspillする.
+// rax, rdx, rdiはidivや関数呼び出しの作業用, rsi, rcx, r8, r9は引数用に
+// 空けておく.
+Reg tmpreg[] = {R10, R11, RBX, R12, R13, R14, R15};
+int nreg;
+int top;
+int peak; // 関数内でレジスタに載った一時値の最大数
+
+// プロローグの後にハードウェアスタックへ積んだ8バイト単位の数.
+// 関数呼び出しの時点でRSPを16バイト境界に揃えるのに使う.
+int depth;
+
+// ローカル変数に回すレジスタの最大数
+#define MAX_PROMOTE 3
 
 int labelseq = 0;
 char *funcname;
 
+// 関数がrbpをフレームポインタに使わないかどうか. そのときローカル変数は
+// rspからの相対で参照する.
+bool omit_fp;
+
+// 生成中の関数と, その関数で末尾呼び出しを最適化してよいかどうか
+Function *gen_fn;
+bool tail_call_ok;
+
+bool is_callee_saved(Reg r) { return r == RBX || r >= R12; }
+
+// `i`番目の一時値がレジスタに載るかどうか
+bool in_reg(int i) { return i < nreg; }
+
+// ローカル変数の領域の先頭から`offset`バイト下にあるメモリ.
+//
+// フレームポインタを省くときは, 関数内でハードウェアスタックに積んだ分を
+// 足してrspからの相対にする. ローカル変数の領域の大きさは本体を生成した
+// 後で決まるので, gen_text()がその分を後から足す.
+Operand frame_op(int offset, int size) {
+  if (omit_fp)
+    return mem_op(RSP, depth * 8 - offset, size);
+  return mem_op(RBP, -offset, size);
+}
+
+void push(Operand op) {
+  emit1(INSN_PUSH, op);
+  depth++;
+}
+
+void pop(Reg r) {
+  emit1(INSN_POP, reg_op(r));
+  depth--;
+}
+
+void grow_tmp() {
+  top++;
+  if (in_reg(top - 1) && peak < top)
+    peak = top;
+}
+
+// `r`の値を新しい一時値として積む
+void push_tmp(Reg r) {
+  if (in_reg(top)) {
+    if (r != tmpreg[top])
+      emit2(INSN_MOV, reg_op(tmpreg[top]), reg_op(r));
+  } else {
+    push(reg_op(r));
+  }
+  grow_tmp();
+}
+
+// 一番上の一時値を取り出し, それを保持するレジスタを返す.
+// spillされていれば`scratch`にpopする.
+Reg pop_tmp(Reg scratch) {
+  top--;
+  if (in_reg(top))
+    return tmpreg[top];
+  pop(scratch);
+  return scratch;
+}
+
+// 一番上の一時値を捨てる
+void drop_tmp() {
+  top--;
+  if (!in_reg(top)) {
+    emit2(INSN_ADD, reg_op(RSP), imm_op(8));
+    depth--;
+  }
+}
+
+// 即値を新しい一時値として積む
+void push_imm(Operand imm) {
+  if (in_reg(top))
+    emit2(INSN_MOV, reg_op(tmpreg[top]), imm);
+  else
+    push(imm);
+  grow_tmp();
+}
+
 // Pushes the given node's address to the stack.
 void gen_addr(Node *node) {
   switch (node->kind) {
   case NODE_VAR: {
+    // グローバル変数はRIP相対で参照するので, 位置独立なコードになる
     Var *var = node->var;
-    if (var->is_local) {
-      printf("    lea rax, [rbp-%d]\n", node->var->offset);
-      printf("    push rax\n");
-    } else {
-      printf("    push offset %s\n", var->name);
-    }
+    Reg r = in_reg(top) ? tmpreg[top] : RAX;
+    assert(!var->is_promoted);
+    if (var->is_local)
+      emit2(INSN_LEA, reg_op(r), frame_op(var->offset, 8));
+    else
+      emit2(INSN_LEA, reg_op(r), sym_op(var->name));
+    push_tmp(r);
     return;
   }
   case NODE_DEREF:
@@ -29,31 +128,463 @@ void gen_addr(Node *node) {
   error_tok(node->tok, "not an lvalue");
 }
 
-void gen_lval(Node *node) {
-  if (node->ty->kind == TY_ARRAY)
-    error_tok(node->tok, "not an lvalue");
-  gen_addr(node);
+// 変数の読み書きはアドレスを一時値に積まず, [rbp-N]や[rip+sym]を直接使う
+Operand var_op(Var *var) {
+  int size = size_of(var->ty);
+  if (var->is_local)
+    return frame_op(var->offset, size);
+  Operand op = sym_op(var->name);
+  op.size = size;
+  return op;
 }
 
-void load(Type *ty) {
-  printf("    pop rax\n");
-  if (size_of(ty) == 1)
-    printf("    movsx rax, byte ptr [rax]\n");
+// 8バイトより小さい値は符号拡張して読む
+void emit_load(Reg r, Operand op) {
+  if (op.size == 8)
+    emit2(INSN_MOV, reg_op(r), op);
   else
-    printf("    mov rax, [rax]\n");
-  printf("    push rax\n");
+    emit2(INSN_MOVSX, reg_op(r), op);
+}
+
+void emit_store(Operand op, Reg r) {
+  emit2(INSN_MOV, op, sized_reg_op(r, op.size));
+}
+
+void load_var(Var *var) {
+  if (var->is_promoted) {
+    push_tmp(var->reg);
+    return;
+  }
+
+  Reg r = in_reg(top) ? tmpreg[top] : RAX;
+  emit_load(r, var_op(var));
+  push_tmp(r);
+}
+
+void store_var(Var *var) {
+  Reg r = pop_tmp(RDI);
+  int size = size_of(var->ty);
+  if (var->is_promoted) {
+    // charやintの変数は代入で切り詰めた値を持つ
+    if (size < 8)
+      emit2(INSN_MOVSX, reg_op(var->reg), sized_reg_op(r, size));
+    else
+      emit2(INSN_MOV, reg_op(var->reg), reg_op(r));
+  } else {
+    emit_store(var_op(var), r);
+  }
+  push_tmp(r);
+}
+
+bool is_scalar_var(Node *node) {
+  return node->kind == NODE_VAR && node->ty->kind != TY_ARRAY;
+}
+
+// 1つのメモリオペランド[base+index*scale+disp]で表したアドレス
+typedef struct {
+  Node *base; // NULLならvarの位置が基底
+  Var *var;   // 配列の変数
+  Node *index;
+  int scale;
+  int disp;
+} Addr;
+
+bool is_scale(Node *node) {
+  return node->kind == NODE_NUM &&
+         (node->val == 2 || node->val == 4 || node->val == 8);
+}
+
+// アドレスを計算する式をAddrの形に分解する.
+// ポインタの加算の右辺にはadd_type()で要素の大きさが掛けてある.
+Addr match_addr(Node *node) {
+  Addr addr = {0};
+  if (node->kind == NODE_ADD && node->rhs->kind == NODE_NUM) {
+    addr.disp = node->rhs->val;
+    node = node->lhs;
+  }
+
+  if (node->kind == NODE_ADD) {
+    Node *rhs = node->rhs;
+    if (rhs->kind == NODE_MUL && is_scale(rhs->rhs)) {
+      addr.index = rhs->lhs;
+      addr.scale = rhs->rhs->val;
+      node = node->lhs;
+    } else if (size_of(node->ty->base) == 1) {
+      addr.index = rhs;
+      addr.scale = 1;
+      node = node->lhs;
+    }
+  }
+
+  // RIP相対のアドレスにはindexを使えない
+  if (node->kind == NODE_VAR && node->ty->kind == TY_ARRAY &&
+      (node->var->is_local || !addr.index))
+    addr.var = node->var;
+  else
+    addr.base = node;
+  return addr;
+}
+
+// レジスタに置いた変数はそのままオペランドに使う
+bool in_var_reg(Node *node) {
+  return node->kind == NODE_VAR && node->var->is_promoted;
+}
+
+// アドレスの基底とindexを一時値に積む
+void gen_addr_parts(Addr *addr) {
+  if (addr->base && !in_var_reg(addr->base))
+    gen(addr->base);
+  if (addr->index && !in_var_reg(addr->index))
+    gen(addr->index);
+}
+
+Reg pop_addr_part(Node *node, Reg scratch) {
+  if (in_var_reg(node))
+    return node->var->reg;
+  return pop_tmp(scratch);
+}
+
+// gen_addr_parts()で積んだ一時値を取り出してメモリオペランドを作る
+Operand addr_op(Addr *addr, int size) {
+  Reg index = addr->index ? pop_addr_part(addr->index, RDX) : RAX;
+
+  Operand op;
+  if (addr->base) {
+    op = mem_op(pop_addr_part(addr->base, RAX), addr->disp, size);
+  } else if (addr->var->is_local) {
+    op = frame_op(addr->var->offset - addr->disp, size);
+  } else {
+    op = sym_op(addr->var->name);
+    op.disp = addr->disp;
+    op.size = size;
+  }
+
+  if (addr->index) {
+    op.index = index;
+    op.scale = addr->scale;
+  }
+  return op;
+}
+
+// *addr
+void gen_deref(Node *node) {
+  Addr addr = match_addr(node->lhs);
+  gen_addr_parts(&addr);
+  Operand op = addr_op(&addr, size_of(node->ty));
+  Reg r = in_reg(top) ? tmpreg[top] : RAX;
+  emit_load(r, op);
+  push_tmp(r);
+}
+
+// *addr = rhs
+void gen_store_deref(Node *node) {
+  Addr addr = match_addr(node->lhs->lhs);
+  gen_addr_parts(&addr);
+  int size = size_of(node->ty);
+
+  if (node->rhs->kind == NODE_NUM) {
+    int val = node->rhs->val;
+    Operand op = addr_op(&addr, size);
+    emit2(INSN_MOV, op, imm_op(size == 1 ? (signed char)val : val));
+    push_imm(imm_op(val));
+    return;
+  }
+
+  gen(node->rhs);
+  Reg r = pop_tmp(RDI);
+  Operand op = addr_op(&addr, size);
+  emit_store(op, r);
+  push_tmp(r);
+}
+
+bool is_compare(Node *node) {
+  switch (node->kind) {
+  case NODE_EQ:
+  case NODE_NE:
+  case NODE_LT:
+  case NODE_LE:
+    return true;
+  default:
+    return false;
+  }
 }
 
-void store(Type *ty) {
-  printf("    pop rdi\n");
-  printf("    pop rax\n");
+// 比較演算子の両辺を評価してcmpを出力し, 比較が真になる条件コードを返す.
+// 右辺が定数ならレジスタに載せずに即値と比較する.
+CondCode gen_compare(Node *node) {
+  gen(node->lhs);
+  if (node->rhs->kind == NODE_NUM) {
+    emit2(INSN_CMP, reg_op(pop_tmp(RAX)), imm_op(node->rhs->val));
+  } else {
+    gen(node->rhs);
+    Reg rd = pop_tmp(RDI);
+    Reg rs = pop_tmp(RAX);
+    emit2(INSN_CMP, reg_op(rs), reg_op(rd));
+  }
 
-  if (size_of(ty) == 1)
-    printf("    mov [rax], dil\n");
+  switch (node->kind) {
+  case NODE_EQ:
+    return CC_E;
+  case NODE_NE:
+    return CC_NE;
+  case NODE_LT:
+    return CC_L;
+  default:
+    return CC_LE;
+  }
+}
+
+// 条件式`cond`の真偽が`jump_if`と一致すれば`label`に飛ぶ.
+//
+// 比較演算子はcmpの結果を0/1の値にせず, そのまま条件分岐に使う.
+void gen_branch(Node *cond, bool jump_if, char *label) {
+  if (cond->kind == NODE_NUM) {
+    if ((cond->val != 0) == jump_if)
+      emit_jmp(label);
+    return;
+  }
+
+  if (is_compare(cond)) {
+    CondCode cc = gen_compare(cond);
+    emit_jcc(jump_if ? cc : negate_cc(cc), label);
+    return;
+  }
+
+  gen(cond);
+  emit2(INSN_CMP, reg_op(pop_tmp(RAX)), imm_op(0));
+  emit_jcc(jump_if ? CC_NE : CC_E, label);
+}
+
+// 2の冪なら指数を, そうでなければ-1を返す
+int log2_of(long val) {
+  if (val <= 0 || (val & (val - 1)))
+    return -1;
+  int k = 0;
+  while (val > 1) {
+    val >>= 1;
+    k++;
+  }
+  return k;
+}
+
+// 定数による乗算
+void gen_mul_imm(Reg r, long val) {
+  int k = log2_of(val);
+  if (val == 0)
+    emit2(INSN_MOV, reg_op(r), imm_op(0));
+  else if (val == -1)
+    emit1(INSN_NEG, reg_op(r));
+  else if (k == 0)
+    ;
+  else if (k > 0)
+    emit2(INSN_SHL, reg_op(r), imm_op(k));
+  else if (val == 3 || val == 5 || val == 9)
+    emit2(INSN_LEA, reg_op(r), index_op(r, r, val - 1, 0, 8));
   else
-    printf("    mov [rax], rdi\n");
+    emit2(INSN_IMUL, reg_op(r), imm_op(val));
+}
+
+// 符号付き除算 n / d の商を n * magic / 2^(64+shift) で求めるための定数
+// (Hacker's Delight 10-1). |d| >= 2であること.
+void div_magic(long d, long *magic, int *shift) {
+  unsigned long two63 = 1UL << 63;
+  unsigned long ad = d < 0 ? -(unsigned long)d : d;
+  unsigned long t = two63 + ((unsigned long)d >> 63);
+  unsigned long anc = t - 1 - t % ad;
+  int p = 63;
+  unsigned long q1 = two63 / anc;
+  unsigned long r1 = two63 - q1 * anc;
+  unsigned long q2 = two63 / ad;
+  unsigned long r2 = two63 - q2 * ad;
+  unsigned long delta;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *magic = q2 + 1;
+  if (d < 0)
+    *magic = -*magic;
+  *shift = p - 64;
+}
+
+// 定数による除算. idivを使わずにシフトや乗算で商を求める.
+void gen_div_imm(Reg r, long val) {
+  if (val == 1)
+    return;
+  if (val == -1) {
+    emit1(INSN_NEG, reg_op(r));
+    return;
+  }
+
+  // 2の冪: 負の数が0の方向に丸められるように, 2^k-1を足してからシフトする
+  int k = log2_of(val < 0 ? -val : val);
+  if (k > 0) {
+    emit2(INSN_MOV, reg_op(RDI), reg_op(r));
+    emit2(INSN_SAR, reg_op(RDI), imm_op(63));
+    emit2(INSN_SHR, reg_op(RDI), imm_op(64 - k));
+    emit2(INSN_ADD, reg_op(r), reg_op(RDI));
+    emit2(INSN_SAR, reg_op(r), imm_op(k));
+    if (val < 0)
+      emit1(INSN_NEG, reg_op(r));
+    return;
+  }
+
+  long magic;
+  int shift;
+  div_magic(val, &magic, &shift);
+
+  Reg n = r;
+  if (r == RAX) {
+    emit2(INSN_MOV, reg_op(RDI), reg_op(RAX));
+    n = RDI;
+  }
+
+  // rdx = (n * magic) >> 64
+  emit2(INSN_MOV, reg_op(RAX), imm_op(magic));
+  emit1(INSN_IMUL, reg_op(n));
+  if (val > 0 && magic < 0)
+    emit2(INSN_ADD, reg_op(RDX), reg_op(n));
+  if (val < 0 && magic > 0)
+    emit2(INSN_SUB, reg_op(RDX), reg_op(n));
+  if (shift)
+    emit2(INSN_SAR, reg_op(RDX), imm_op(shift));
 
-  printf("    push rdi\n");
+  // 商が負なら1を足して0の方向に丸める
+  emit2(INSN_MOV, reg_op(RAX), reg_op(RDX));
+  emit2(INSN_SHR, reg_op(RAX), imm_op(63));
+  emit2(INSN_ADD, reg_op(RDX), reg_op(RAX));
+  emit2(INSN_MOV, reg_op(r), reg_op(RDX));
+}
+
+// 右辺が定数の2項演算は即値やシフトを使う. 使えなければfalseを返す.
+bool gen_binary_imm(Node *node) {
+  long val = node->rhs->val;
+  if (node->kind == NODE_DIV && val == 0)
+    return false;
+
+  gen(node->lhs);
+  Reg r = pop_tmp(RAX);
+
+  switch (node->kind) {
+  case NODE_ADD:
+    emit2(INSN_ADD, reg_op(r), imm_op(val));
+    break;
+  case NODE_SUB:
+    emit2(INSN_SUB, reg_op(r), imm_op(val));
+    break;
+  case NODE_MUL:
+    gen_mul_imm(r, val);
+    break;
+  case NODE_DIV:
+    gen_div_imm(r, val);
+    break;
+  }
+
+  push_tmp(r);
+  return true;
+}
+
+// 関数呼び出しの引数を評価して引数レジスタに入れる
+void gen_args(Node *node) {
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next) {
+    gen(arg);
+    nargs++;
+  }
+
+  for (int i = nargs - 1; i >= 0; i--) {
+    Reg r = pop_tmp(argreg[i]);
+    if (r != argreg[i])
+      emit2(INSN_MOV, reg_op(argreg[i]), reg_op(r));
+  }
+}
+
+// 関数を抜ける前に, 式の評価中にハードウェアスタックに積んだ一時値を捨てる.
+// フレームポインタがあればエピローグがrspを戻すので要らない.
+void discard_stack() {
+  if (omit_fp && depth)
+    emit2(INSN_ADD, reg_op(RSP), imm_op(depth * 8));
+}
+
+// `return f(...);`を末尾呼び出しにできるかどうか.
+// ローカル変数のアドレスを取る関数では, 呼び出し先がそのアドレスを
+// 使うかもしれないのでフレームを残す. 戻り値が自分の戻り値の型より
+// 小さければ呼び出し後の符号拡張が要るので, 普通に呼ぶ.
+bool is_tail_call(Node *node) {
+  if (!opt_tail_call || !tail_call_ok || node->kind != NODE_RETURN ||
+      node->lhs->kind != NODE_FUNCALL)
+    return false;
+  if (size_of(node->lhs->ty) < size_of(gen_fn->ty))
+    return false;
+
+  int nargs = 0;
+  for (Node *arg = node->lhs->args; arg; arg = arg->next)
+    nargs++;
+  return nargs <= 6;
+}
+
+// 引数の数が同じ自分自身への末尾呼び出しはループにする
+bool is_self_tail_call(Node *node) {
+  if (!is_tail_call(node) || node->lhs->funcname != gen_fn->name)
+    return false;
+
+  Node *arg = node->lhs->args;
+  VarList *vl = gen_fn->params;
+  for (; arg && vl; arg = arg->next, vl = vl->next)
+    ;
+  return !arg && !vl;
+}
+
+// 末尾呼び出しでは引数を入れ替えてから呼び出し先へjmpする.
+// 関数名へのjmpの前には, gen_text()がエピローグを挿入する.
+void gen_tail_call(Node *node) {
+  gen_args(node->lhs);
+
+  if (is_self_tail_call(node)) {
+    int i = 0;
+    for (VarList *vl = gen_fn->params; vl; vl = vl->next)
+      load_arg(vl->var, i++);
+    // ループの先頭に戻るので, フレームポインタがあっても積んだ一時値を捨てる
+    if (depth)
+      emit2(INSN_ADD, reg_op(RSP), imm_op(depth * 8));
+    emit_jmp(format(".Lbody.%s", funcname));
+    return;
+  }
+
+  discard_stack();
+  emit2(INSN_MOV, reg_op(RAX), imm_op(0));
+  emit_jmp(node->lhs->funcname);
+}
+
+// 関数の最後の文のreturnはエピローグへ飛ばずにそのまま落ちる
+void gen_return(Node *node, bool jump) {
+  if (is_tail_call(node)) {
+    gen_tail_call(node);
+    return;
+  }
+
+  gen(node->lhs);
+  Reg r = pop_tmp(RAX);
+  if (r != RAX)
+    emit2(INSN_MOV, reg_op(RAX), reg_op(r));
+  if (jump) {
+    discard_stack();
+    emit_jmp(format(".Lreturn.%s", funcname));
+  }
 }
 
 // Generate code for a given node.
@@ -62,80 +593,69 @@ void gen(Node *node) {
   case NODE_NULL:
     return;
   case NODE_NUM:
-    printf("    push %d\n", node->val);
+    push_imm(imm_op(node->val));
     return;
   case NODE_EXPR_STMT:
     gen(node->lhs);
-    printf("    add rsp, 8\n");
+    drop_tmp();
     return;
   case NODE_VAR:
-    gen_addr(node);
-    if (node->ty->kind != TY_ARRAY)
-      load(node->ty);
+    if (is_scalar_var(node))
+      load_var(node->var);
+    else
+      gen_addr(node);
     return;
   case NODE_ASSIGN:
-    gen_lval(node->lhs);
-    gen(node->rhs);
-    store(node->ty);
+    if (is_scalar_var(node->lhs)) {
+      gen(node->rhs);
+      store_var(node->lhs->var);
+    } else {
+      gen_store_deref(node);
+    }
     return;
   case NODE_ADDR:
     gen_addr(node->lhs);
     return;
   case NODE_DEREF:
-    gen(node->lhs);
-    if (node->ty->kind != TY_ARRAY)
-      load(node->ty);
+    if (node->ty->kind == TY_ARRAY)
+      gen(node->lhs);
+    else
+      gen_deref(node);
     return;
   case NODE_IF: {
     int seq = labelseq++;
     if (node->els) {
-      gen(node->cond);
-      printf("    pop rax\n");
-      printf("    cmp rax, 0\n");
-      printf("    je .Lelse%d\n", seq);
+      gen_branch(node->cond, false, format(".Lelse%d", seq));
       gen(node->then);
-      printf("    jmp .Lend%d\n", seq);
-      printf(".Lelse%d:\n", seq);
+      emit_jmp(format(".Lend%d", seq));
+      emit_label(format(".Lelse%d", seq));
       gen(node->els);
-      printf(".Lend%d:\n", seq);
+      emit_label(format(".Lend%d", seq));
     } else {
-      gen(node->cond);
-      printf("    pop rax\n");
-      printf("    cmp rax, 0\n");
-      printf("    je  .Lend%d\n", seq);
+      gen_branch(node->cond, false, format(".Lend%d", seq));
       gen(node->then);
-      printf(".Lend%d:\n", seq);
+      emit_label(format(".Lend%d", seq));
     }
     return;
   }
-  case NODE_WHILE: {
-    int seq = labelseq++;
-    printf(".Lbegin%d:\n", seq);
-    gen(node->cond);
-    printf("    pop rax\n");
-    printf("    cmp rax, 0\n");
-    printf("    je  .Lend%d\n", seq);
-    gen(node->then);
-    printf("    jmp .Lbegin%d\n", seq);
-    printf(".Lend%d:\n", seq);
-    return;
-  }
+  case NODE_WHILE:
   case NODE_FOR: {
+    // 条件判定をループの末尾に置き, 1周あたりの分岐を1つにする
     int seq = labelseq++;
     if (node->init)
       gen(node->init);
-    printf(".Lbegin%d:\n", seq);
-    if (node->cond) {
-      gen(node->cond);
-      printf("    pop rax\n");
-      printf("    cmp rax, 0\n");
-      printf("    je  .Lend%d\n", seq);
-    }
+    if (node->cond)
+      emit_jmp(format(".Lcond%d", seq));
+    emit_label(format(".Lbegin%d", seq));
     gen(node->then);
     if (node->inc)
       gen(node->inc);
-    printf("    jmp .Lbegin%d\n", seq);
-    printf(".Lend%d:\n", seq);
+    if (node->cond) {
+      emit_label(format(".Lcond%d", seq));
+      gen_branch(node->cond, true, format(".Lbegin%d", seq));
+    } else {
+      emit_jmp(format(".Lbegin%d", seq));
+    }
     return;
   }
   case NODE_BLOCK:
@@ -144,152 +664,461 @@ void gen(Node *node) {
       gen(n);
     return;
   case NODE_FUNCALL: {
-    int nargs = 0;
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      gen(arg);
-      nargs++;
-    }
+    gen_args(node);
 
-    for (int i = nargs - 1; i >= 0; i--) {
-      printf("    pop %s\n", argreg8[i]);
-    }
+    // 呼び出しをまたいで生きている一時値のうち,
+    // caller-savedなレジスタにあるものを退避する
+    for (int i = 0; i < top && in_reg(i); i++)
+      if (!is_callee_saved(tmpreg[i]))
+        push(reg_op(tmpreg[i]));
 
-    // よくわからんけど
-    // RSPを16byteに揃っていなければいけない
-    // らしい
-    int seq = labelseq++;
-    printf("  mov rax, rsp\n");
-    printf("  and rax, 15\n");
-    printf("  jnz .Lcall%d\n", seq);
-    printf("  mov rax, 0\n");
-    printf("  call %s\n", node->funcname);
-    printf("  jmp .Lend%d\n", seq);
-    printf(".Lcall%d:\n", seq);
-    printf("  sub rsp, 8\n");
-    printf("  mov rax, 0\n");
-    printf("    call %s\n", node->funcname);
-    printf("  add rsp, 8\n");
-    printf(".Lend%d:\n", seq);
-    printf("    push rax\n");
+    // RSPは関数呼び出しの時点で16バイト境界に揃っていなければいけない.
+    // フレームの大きさは16の倍数なので, 積んだ数が奇数なら8バイトずらす.
+    bool pad = depth % 2;
+    if (pad)
+      emit2(INSN_SUB, reg_op(RSP), imm_op(8));
+    emit2(INSN_MOV, reg_op(RAX), imm_op(0));
+    emit_call(node->funcname);
+    if (pad)
+      emit2(INSN_ADD, reg_op(RSP), imm_op(8));
+
+    // 戻り値の上位ビットは不定なので符号拡張する
+    int size = size_of(node->ty);
+    if (size < 8)
+      emit2(INSN_MOVSX, reg_op(RAX), sized_reg_op(RAX, size));
+
+    for (int i = top - 1; i >= 0; i--)
+      if (in_reg(i) && !is_callee_saved(tmpreg[i]))
+        pop(tmpreg[i]);
+
+    push_tmp(RAX);
+    return;
+  }
+  case NODE_EQ:
+  case NODE_NE:
+  case NODE_LT:
+  case NODE_LE: {
+    CondCode cc = gen_compare(node);
+    Reg r = in_reg(top) ? tmpreg[top] : RAX;
+    emit_setcc(cc, r);
+    emit2(INSN_MOVZX, reg_op(r), reg8_op(r));
+    push_tmp(r);
     return;
   }
   case NODE_RETURN:
+    gen_return(node, true);
+    return;
+  }
+
+  if (node->rhs->kind == NODE_NUM && gen_binary_imm(node))
+    return;
+
+  // ポインタの加算 p + i*n (n = 2, 4, 8) => lea p, [p+i*n]
+  Node *rhs = node->rhs;
+  if (node->kind == NODE_ADD && rhs->kind == NODE_MUL &&
+      rhs->rhs->kind == NODE_NUM &&
+      (rhs->rhs->val == 2 || rhs->rhs->val == 4 || rhs->rhs->val == 8)) {
     gen(node->lhs);
-    printf("    pop rax\n");
-    printf("    jmp .Lreturn.%s\n", funcname);
+    gen(rhs->lhs);
+    Reg rd = pop_tmp(RDI);
+    Reg rs = pop_tmp(RAX);
+    emit2(INSN_LEA, reg_op(rs), index_op(rs, rd, rhs->rhs->val, 0, 8));
+    push_tmp(rs);
     return;
   }
 
   gen(node->lhs);
   gen(node->rhs);
 
-  printf("    pop rdi\n");
-  printf("    pop rax\n");
+  Reg rd = pop_tmp(RDI);
+  Reg rs = pop_tmp(RAX);
+  Operand d = reg_op(rd);
+  Operand s = reg_op(rs);
 
   switch (node->kind) {
   case NODE_ADD:
-    if (node->ty->base)
-      printf("    imul rdi, %d\n", size_of(node->ty->base));
-    printf("    add rax, rdi\n");
+    emit2(INSN_ADD, s, d);
     break;
   case NODE_SUB:
-    if (node->ty->base)
-      printf("    imul rdi, %d\n", size_of(node->ty->base));
-    printf("    sub rax, rdi\n");
+    emit2(INSN_SUB, s, d);
     break;
   case NODE_MUL:
-    printf("    imul rax, rdi\n");
+    emit2(INSN_IMUL, s, d);
     break;
   case NODE_DIV:
-    printf("    cqo\n");
-    printf("    idiv rdi\n");
-    break;
-  case NODE_EQ:
-    printf("    cmp rax, rdi\n");
-    printf("    sete al\n");
-    printf("    movzb rax, al\n");
-    break;
-  case NODE_NE:
-    printf("    cmp rax, rdi\n");
-    printf("    setne al\n");
-    printf("    movzb rax, al\n");
-    break;
-  case NODE_LT:
-    printf("    cmp rax, rdi\n");
-    printf("    setl al\n");
-    printf("    movzb rax, al\n");
-    break;
-  case NODE_LE:
-    printf("    cmp rax, rdi\n");
-    printf("    setle al\n");
-    printf("    movzb rax, al\n");
+    if (rs != RAX)
+      emit2(INSN_MOV, reg_op(RAX), s);
+    emit0(INSN_CQO);
+    emit1(INSN_IDIV, d);
+    if (rs != RAX)
+      emit2(INSN_MOV, s, reg_op(RAX));
     break;
   }
 
-  printf("    push rax\n");
+  push_tmp(rs);
 }
 
+// 引数レジスタの値は上位ビットが不定なので, レジスタに置く変数は符号拡張する
 void load_arg(Var *var, int idx) {
   int sz = size_of(var->ty);
-  if (sz == 1) {
-    printf("    mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
-  } else {
-    assert(sz == 8);
-    printf("    mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
+  if (!var->is_promoted)
+    emit_store(frame_op(var->offset, sz), argreg[idx]);
+  else if (sz < 8)
+    emit2(INSN_MOVSX, reg_op(var->reg), sized_reg_op(argreg[idx], sz));
+  else
+    emit2(INSN_MOV, reg_op(var->reg), reg_op(argreg[idx]));
+}
+
+// 文字列リテラルの中身を`.string`のオペランドとして出力する
+void emit_string(char *s, int len) {
+  out_char('"');
+  for (int i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      out_char('\\');
+      out_char(c);
+    } else if (' ' <= c && c <= '~') {
+      out_char(c);
+    } else {
+      // 続く数字と混ざらないよう常に3桁の8進数で書く
+      char buf[4] = {'\\', '0' + (c >> 6), '0' + ((c >> 3) & 7),
+                     '0' + (c & 7)};
+      out_mem(buf, 4);
+    }
   }
+  out_char('"');
 }
 
+// 文字列リテラルを中身の末尾から比べる
+int cmp_reversed(const void *a, const void *b) {
+  Var *x = *(Var **)a;
+  Var *y = *(Var **)b;
+  int n = x->cont_len < y->cont_len ? x->cont_len : y->cont_len;
+  for (int i = 1; i <= n; i++) {
+    unsigned char c = x->contents[x->cont_len - i];
+    unsigned char d = y->contents[y->cont_len - i];
+    if (c != d)
+      return c - d;
+  }
+  return x->cont_len - y->cont_len;
+}
+
+bool is_suffix(Var *s, Var *t) {
+  return s->cont_len <= t->cont_len &&
+         !memcmp(s->contents, t->contents + t->cont_len - s->cont_len,
+                 s->cont_len);
+}
+
+// "bc"のように他の文字列リテラル"abc"の末尾と同じものは, そちらの領域を
+// 共有する. 末尾から比べた順に並べると, ある文字列を末尾に持つ文字列は
+// そのすぐ後ろに並ぶ.
+void merge_string_suffixes(Program *prog) {
+  int n = 0;
+  for (VarList *vl = prog->globals; vl; vl = vl->next)
+    if (vl->var->contents)
+      n++;
+  if (n == 0)
+    return;
+
+  Var **strs = calloc(n, sizeof(Var *));
+  int i = 0;
+  for (VarList *vl = prog->globals; vl; vl = vl->next)
+    if (vl->var->contents)
+      strs[i++] = vl->var;
+  qsort(strs, n, sizeof(Var *), cmp_reversed);
+
+  for (int i = n - 2; i >= 0; i--) {
+    Var *s = strs[i];
+    Var *t = strs[i + 1];
+    if (!is_suffix(s, t))
+      continue;
+    Var *base = t->suffix_of ? t->suffix_of : t;
+    s->suffix_of = base;
+    s->suffix_offset = base->cont_len - s->cont_len;
+  }
+  free(strs);
+}
+
+// 初期値のないグローバル変数は`.bss`に, 文字列リテラルは`.rodata`に置く
 void emit_data(Program *prog) {
-  printf(".data\n");
+  out_str(".bss\n");
+  for (VarList *vl = prog->globals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    if (var->contents)
+      continue;
+
+    out_str(".align ");
+    out_int(align_of(var->ty));
+    out_char('\n');
+    out_str(var->name);
+    out_str(":\n    .zero ");
+    out_int(size_of(var->ty));
+    out_char('\n');
+  }
 
+  out_str(".section .rodata\n");
   for (VarList *vl = prog->globals; vl; vl = vl->next) {
     Var *var = vl->var;
-    printf("%s:\n", var->name);
+    if (!var->contents)
+      continue;
 
-    if (!var->contents) {
-      printf("    .zero %d\n", size_of(var->ty));
+    if (var->suffix_of) {
+      out_str(".set ");
+      out_str(var->name);
+      out_str(", ");
+      out_str(var->suffix_of->name);
+      out_char('+');
+      out_int(var->suffix_offset);
+      out_char('\n');
       continue;
     }
 
-    for (int i = 0; i < var->cont_len; i++)
-      printf("    .byte %d\n", var->contents[i]);
+    // `.string`は末尾に'\0'を付ける
+    assert(var->contents[var->cont_len - 1] == '\0');
+    out_str(var->name);
+    out_str(":\n    .string ");
+    emit_string(var->contents, var->cont_len - 1);
+    out_char('\n');
   }
 }
 
-void emit_text(Program *prog) {
-  printf(".text\n");
+bool has_call(Node *node) {
+  if (!node)
+    return false;
+  if (node->kind == NODE_FUNCALL)
+    return true;
+
+  // 自分自身への末尾呼び出しはループになるので呼び出しではない
+  if (is_self_tail_call(node)) {
+    for (Node *n = node->lhs->args; n; n = n->next)
+      if (has_call(n))
+        return true;
+    return false;
+  }
+
+  if (has_call(node->lhs) || has_call(node->rhs) || has_call(node->cond) ||
+      has_call(node->then) || has_call(node->els) || has_call(node->init) ||
+      has_call(node->inc))
+    return true;
+  for (Node *n = node->body; n; n = n->next)
+    if (has_call(n))
+      return true;
+  for (Node *n = node->args; n; n = n->next)
+    if (has_call(n))
+      return true;
+  return false;
+}
+
+bool has_mem_locals(Function *fn) {
+  for (VarList *vl = fn->locals; vl; vl = vl->next)
+    if (!vl->var->is_promoted)
+      return true;
+  return false;
+}
+
+bool is_leaf(Function *fn) {
+  for (Node *node = fn->node; node; node = node->next)
+    if (has_call(node))
+      return false;
+  return true;
+}
+
+// フレームポインタを省いたときのローカル変数の領域の大きさ
+int omit_fp_frame_size(Function *fn, int nsave, bool leaf) {
+  int size = has_mem_locals(fn) ? fn->stack_size : 0;
+
+  // 呼び出しの時点でRSPが16バイト境界に揃うように, リターンアドレスと
+  // 退避したレジスタの分も含めて16の倍数にする
+  if (!leaf)
+    size = align_to(size + 8 + nsave * 8, 16) - 8 - nsave * 8;
+  return size;
+}
+
+// フレームポインタを使うときは, 退避するレジスタをローカル変数の下に置く.
+// 使わないときは, 退避するレジスタをpushしてからローカル変数の領域を
+// 確保する.
+void emit_prologue(Function *fn, Reg *saved, int nsave, int size) {
+  if (omit_fp) {
+    for (int i = 0; i < nsave; i++)
+      emit1(INSN_PUSH, reg_op(saved[i]));
+    if (size)
+      emit2(INSN_SUB, reg_op(RSP), imm_op(size));
+    return;
+  }
+
+  emit1(INSN_PUSH, reg_op(RBP));
+  emit2(INSN_MOV, reg_op(RBP), reg_op(RSP));
+  if (fn->stack_size + nsave)
+    emit2(INSN_SUB, reg_op(RSP),
+          imm_op(align_to(fn->stack_size + nsave * 8, 16)));
+  for (int i = 0; i < nsave; i++)
+    emit2(INSN_MOV, mem_op(RBP, -(fn->stack_size + (i + 1) * 8), 8),
+          reg_op(saved[i]));
+}
+
+// retの直前までのエピローグ
+void emit_epilogue(Function *fn, Reg *saved, int nsave, int size) {
+  if (omit_fp) {
+    if (size)
+      emit2(INSN_ADD, reg_op(RSP), imm_op(size));
+    for (int i = nsave - 1; i >= 0; i--)
+      emit1(INSN_POP, reg_op(saved[i]));
+    return;
+  }
+
+  for (int i = 0; i < nsave; i++)
+    emit2(INSN_MOV, reg_op(saved[i]),
+          mem_op(RBP, -(fn->stack_size + (i + 1) * 8), 8));
+  emit2(INSN_MOV, reg_op(RSP), reg_op(RBP));
+  emit1(INSN_POP, reg_op(RBP));
+}
+
+// 全関数の命令列を作る
+void gen_text(Program *prog) {
+  int ntmp = sizeof(tmpreg) / sizeof(*tmpreg);
 
   for (Function *fn = prog->fns; fn; fn = fn->next) {
-    printf(".global %s\n", fn->name);
-    printf("%s:\n", fn->name);
+    emit_label(fn->name);
     funcname = fn->name;
+    gen_fn = fn;
+    tail_call_ok = !takes_local_addr(fn);
+    Insn *entry = cursor;
+    peak = 0;
+
+    // 関数を呼ぶなら, tmpregの後ろのcallee-savedなレジスタを最大
+    // MAX_PROMOTE個までローカル変数に回し, 残りを一時値に使う.
+    // 呼ばないなら, 引数の受け渡しに使わない引数レジスタを回す.
+    bool leaf = is_leaf(fn);
+    int npromote = 0;
+    int nvar_regs = 0;
+    if (opt_mem2reg && leaf) {
+      Reg regs[] = {R9, R8, RCX, RSI};
+      int n = 0;
+      for (int i = 0; i < 4; i++) {
+        bool is_arg = false;
+        int j = 0;
+        for (VarList *vl = fn->params; vl; vl = vl->next)
+          if (argreg[j++] == regs[i])
+            is_arg = true;
+        if (!is_arg)
+          regs[n++] = regs[i];
+      }
+      nvar_regs = promote_vars(fn, regs, n < MAX_PROMOTE ? n : MAX_PROMOTE);
+    } else if (opt_mem2reg) {
+      npromote = promote_vars(fn, tmpreg + ntmp - MAX_PROMOTE, MAX_PROMOTE);
+      nvar_regs = npromote;
+    }
+    nreg = opt_regalloc ? ntmp - npromote : 0;
+
+    // レジスタに置いた変数を除いてフレームを作り直す
+    if (nvar_regs)
+      layout_frame(fn);
 
-    // Prologue
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    printf("  sub rsp, %d\n", fn->stack_size);
+    // 関数を呼ばず, メモリに置くローカル変数もない関数はフレームを作らない
+    bool frame = !leaf || has_mem_locals(fn);
+    omit_fp = opt_omit_frame_pointer || !frame;
 
     // Push arguments to the stack
     int i = 0;
     for (VarList *vl = fn->params; vl; vl = vl->next) {
       load_arg(vl->var, i++);
     }
+    emit_label(format(".Lbody.%s", funcname));
 
     // Emit code
-    for (Node *node = fn->node; node; node = node->next)
-      gen(node);
+    for (Node *node = fn->node; node; node = node->next) {
+      if (!node->next && node->kind == NODE_RETURN)
+        gen_return(node, false);
+      else
+        gen(node);
+      assert(top == 0 && depth == 0);
+    }
+
+    // 関数内で使った一時値レジスタと, ローカル変数を置いたレジスタの
+    // うち, callee-savedなものを退避する
+    Reg saved[sizeof(tmpreg) / sizeof(*tmpreg)];
+    int nsave = 0;
+    for (int i = 0; i < peak; i++)
+      if (is_callee_saved(tmpreg[i]))
+        saved[nsave++] = tmpreg[i];
+    for (VarList *vl = fn->locals; vl; vl = vl->next)
+      if (vl->var->is_promoted && is_callee_saved(vl->var->reg))
+        saved[nsave++] = vl->var->reg;
+
+    int size = 0;
+    if (omit_fp) {
+      // frame_op()で作ったrsp相対の参照にローカル変数の領域の大きさを足す
+      size = omit_fp_frame_size(fn, nsave, !frame);
+      for (Insn *insn = entry->next; insn; insn = insn->next) {
+        if (insn->dst.kind == OPND_MEM && insn->dst.reg == RSP)
+          insn->dst.disp += size;
+        if (insn->src.kind == OPND_MEM && insn->src.reg == RSP)
+          insn->src.disp += size;
+      }
+    }
 
-    // Epilogue
-    printf(".Lreturn.%s:\n", funcname);
-    printf("  mov rsp, rbp\n");
-    printf("  pop rbp\n");
-    printf("  ret\n");
+    // 末尾呼び出しのjmpの前にもエピローグを置く
+    Insn *last = cursor;
+    for (Insn *insn = entry->next; insn; insn = insn->next) {
+      if (insn->kind == INSN_JMP && strncmp(insn->label, ".L", 2)) {
+        cursor = insn->prev;
+        emit_epilogue(fn, saved, nsave, size);
+      }
+    }
+    cursor = last;
+
+    emit_label(format(".Lreturn.%s", funcname));
+    emit_epilogue(fn, saved, nsave, size);
+    emit0(INSN_RET);
+    Insn *end = cursor;
+
+    // 本体を生成した後で退避するレジスタが決まるので,
+    // プロローグは関数の先頭に挿入する
+    cursor = entry;
+    emit_prologue(fn, saved, nsave, size);
+    cursor = end;
+  }
+  omit_fp = false;
+
+  if (opt_peephole)
+    peephole(insns);
+}
+
+void emit_text(Program *prog) {
+  out_str(".text\n");
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    out_str(".global ");
+    out_str(fn->name);
+    out_char('\n');
   }
+  print_insns(insns);
 }
 
 void codegen(Program *prog) {
-  printf(".intel_syntax noprefix\n");
+  if (opt_ir || opt_dump_ir) {
+    lower_ir(prog);
+    verify_ir(prog);
+    if (opt_dump_ir) {
+      dump_ir(prog);
+      return;
+    }
+  }
+
+  if (opt_ir)
+    gen_ir_text(prog);
+  else
+    gen_text(prog);
+  merge_string_suffixes(prog);
+
+  if (opt_emit_obj || opt_run) {
+    assemble(prog, insns);
+    if (opt_emit_obj)
+      emit_elf();
+    return;
+  }
+
+  out_str(".intel_syntax noprefix\n");
   emit_data(prog);
   emit_text(prog);
-  printf(".section	.note.GNU-stack,\"\",@progbits\n");
+  out_str(".section	.note.GNU-stack,\"\",@progbits\n");
 }
@@ -0,0 +1,212 @@
+#include "poacc.h"
+
+#include <elf.h>
+
+// ELF64の再配置可能オブジェクトファイルの書き出し
+//
+// assemble()で作ったセクション, シンボルと再配置をそのまま書き出す.
+// ファイルはELFヘッダ, 各セクションの中身, セクションヘッダの順に並べる.
+
+enum {
+  SH_NULL,
+  SH_TEXT = SEC_TEXT,
+  SH_DATA = SEC_DATA,
+  SH_BSS = SEC_BSS,
+  SH_RODATA = SEC_RODATA,
+  SH_SYMTAB,
+  SH_STRTAB,
+  SH_RELA_TEXT,
+  SH_SHSTRTAB,
+  SH_NOTE_GNU_STACK,
+  NSH,
+};
+
+// 文字列テーブル
+typedef struct {
+  char *data;
+  int size;
+  int cap;
+} StrTab;
+
+int strtab_add(StrTab *tab, char *s) {
+  int len = strlen(s) + 1;
+  if (tab->size + len > tab->cap) {
+    tab->cap = (tab->cap + len) * 2;
+    tab->data = realloc(tab->data, tab->cap);
+  }
+  int off = tab->size;
+  memcpy(tab->data + off, s, len);
+  tab->size += len;
+  return off;
+}
+
+// ".L"で始まるラベルはシンボルテーブルに入れず, セクションからの
+// オフセットとして参照する
+bool is_local_label(ObjSym *sym) {
+  return !strncmp(sym->name, ".L", 2) && sym->sec != SEC_UNDEF;
+}
+
+void pad_output(long off) {
+  while (output_len() < off)
+    out_char('\0');
+}
+
+void emit_elf() {
+  StrTab strtab = {0};
+  StrTab shstrtab = {0};
+  strtab_add(&strtab, "");
+  strtab_add(&shstrtab, "");
+
+  // シンボルテーブル. ローカルなシンボルを先に並べる.
+  int nsym = 1 + SEC_RODATA + nsyms;
+  Elf64_Sym *syms = calloc(nsym, sizeof(Elf64_Sym));
+  int n = 1;
+
+  for (int i = SEC_TEXT; i <= SEC_RODATA; i++) {
+    syms[n].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    syms[n].st_shndx = i;
+    n++;
+  }
+
+  int first_global = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1)
+      first_global = n;
+
+    // 作った順に並べたいので, 逆順のリストを後ろからたどる
+    ObjSym **list = calloc(nsyms, sizeof(ObjSym *));
+    int cnt = 0;
+    for (ObjSym *sym = objsyms; sym; sym = sym->older)
+      list[cnt++] = sym;
+
+    for (int i = cnt - 1; i >= 0; i--) {
+      ObjSym *sym = list[i];
+      if (sym->is_global != pass || is_local_label(sym))
+        continue;
+
+      Elf64_Sym *esym = &syms[n];
+      sym->index = n++;
+      esym->st_name = strtab_add(&strtab, sym->name);
+      esym->st_info = ELF64_ST_INFO(sym->is_global ? STB_GLOBAL : STB_LOCAL,
+                                    sym->is_func          ? STT_FUNC
+                                    : sym->sec == SEC_UNDEF ? STT_NOTYPE
+                                                            : STT_OBJECT);
+      esym->st_shndx = sym->sec;
+      esym->st_value = sym->offset;
+    }
+    free(list);
+  }
+  nsym = n;
+
+  // .rela.text
+  int nrela = 0;
+  for (Reloc *rel = relocs; rel; rel = rel->next)
+    nrela++;
+  Elf64_Rela *rela = calloc(nrela ? nrela : 1, sizeof(Elf64_Rela));
+  int i = nrela;
+  for (Reloc *rel = relocs; rel; rel = rel->next) {
+    Elf64_Rela *r = &rela[--i];
+    ObjSym *sym = rel->sym;
+    int type = (rel->type == RELOC_PLT32) ? R_X86_64_PLT32 : R_X86_64_PC32;
+    r->r_offset = rel->offset;
+    r->r_addend = rel->addend;
+    if (is_local_label(sym)) {
+      r->r_info = ELF64_R_INFO(sym->sec, type);
+      r->r_addend += sym->offset;
+    } else {
+      r->r_info = ELF64_R_INFO(sym->index, type);
+    }
+  }
+
+  // セクションヘッダ
+  Elf64_Shdr shdr[NSH] = {0};
+  for (int i = SEC_TEXT; i <= SEC_RODATA; i++) {
+    Section *sec = &sections[i];
+    shdr[i].sh_name = strtab_add(&shstrtab, sec->name);
+    shdr[i].sh_type = (i == SEC_BSS) ? SHT_NOBITS : SHT_PROGBITS;
+    shdr[i].sh_size = sec->size;
+    shdr[i].sh_addralign = sec->align;
+  }
+  shdr[SH_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  shdr[SH_DATA].sh_flags = SHF_ALLOC | SHF_WRITE;
+  shdr[SH_BSS].sh_flags = SHF_ALLOC | SHF_WRITE;
+  shdr[SH_RODATA].sh_flags = SHF_ALLOC;
+
+  shdr[SH_SYMTAB].sh_name = strtab_add(&shstrtab, ".symtab");
+  shdr[SH_SYMTAB].sh_type = SHT_SYMTAB;
+  shdr[SH_SYMTAB].sh_size = nsym * sizeof(Elf64_Sym);
+  shdr[SH_SYMTAB].sh_link = SH_STRTAB;
+  shdr[SH_SYMTAB].sh_info = first_global;
+  shdr[SH_SYMTAB].sh_addralign = 8;
+  shdr[SH_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+
+  shdr[SH_STRTAB].sh_name = strtab_add(&shstrtab, ".strtab");
+  shdr[SH_STRTAB].sh_type = SHT_STRTAB;
+  shdr[SH_STRTAB].sh_size = strtab.size;
+  shdr[SH_STRTAB].sh_addralign = 1;
+
+  shdr[SH_RELA_TEXT].sh_name = strtab_add(&shstrtab, ".rela.text");
+  shdr[SH_RELA_TEXT].sh_type = SHT_RELA;
+  shdr[SH_RELA_TEXT].sh_flags = SHF_INFO_LINK;
+  shdr[SH_RELA_TEXT].sh_size = nrela * sizeof(Elf64_Rela);
+  shdr[SH_RELA_TEXT].sh_link = SH_SYMTAB;
+  shdr[SH_RELA_TEXT].sh_info = SH_TEXT;
+  shdr[SH_RELA_TEXT].sh_addralign = 8;
+  shdr[SH_RELA_TEXT].sh_entsize = sizeof(Elf64_Rela);
+
+  shdr[SH_NOTE_GNU_STACK].sh_name =
+      strtab_add(&shstrtab, ".note.GNU-stack");
+  shdr[SH_NOTE_GNU_STACK].sh_type = SHT_PROGBITS;
+  shdr[SH_NOTE_GNU_STACK].sh_addralign = 1;
+
+  shdr[SH_SHSTRTAB].sh_name = strtab_add(&shstrtab, ".shstrtab");
+  shdr[SH_SHSTRTAB].sh_type = SHT_STRTAB;
+  shdr[SH_SHSTRTAB].sh_size = shstrtab.size;
+  shdr[SH_SHSTRTAB].sh_addralign = 1;
+
+  // ファイル内の配置
+  void *contents[NSH] = {
+      [SH_TEXT] = sections[SEC_TEXT].data,
+      [SH_DATA] = sections[SEC_DATA].data,
+      [SH_RODATA] = sections[SEC_RODATA].data,
+      [SH_SYMTAB] = syms,
+      [SH_STRTAB] = strtab.data,
+      [SH_RELA_TEXT] = rela,
+      [SH_SHSTRTAB] = shstrtab.data,
+  };
+
+  long off = sizeof(Elf64_Ehdr);
+  for (int i = 1; i < NSH; i++) {
+    off = align_to(off, shdr[i].sh_addralign ? shdr[i].sh_addralign : 1);
+    shdr[i].sh_offset = off;
+    if (shdr[i].sh_type != SHT_NOBITS)
+      off += shdr[i].sh_size;
+  }
+  long shoff = align_to(off, 8);
+
+  Elf64_Ehdr ehdr = {0};
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  ehdr.e_type = ET_REL;
+  ehdr.e_machine = EM_X86_64;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_shoff = shoff;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = NSH;
+  ehdr.e_shstrndx = SH_SHSTRTAB;
+
+  long base = output_len();
+  out_mem((char *)&ehdr, sizeof(ehdr));
+  for (int i = 1; i < NSH; i++) {
+    if (shdr[i].sh_type == SHT_NOBITS || !shdr[i].sh_size)
+      continue;
+    pad_output(base + shdr[i].sh_offset);
+    out_mem(contents[i], shdr[i].sh_size);
+  }
+  pad_output(base + shoff);
+  out_mem((char *)shdr, sizeof(shdr));
+}
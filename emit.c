@@ -0,0 +1,76 @@
+#include "poacc.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// アセンブリの出力バッファ
+//
+// 出力はすべてこのバッファに追記し, 最後にwrite_output()でまとめて書き出す.
+// 文字列と整数の追記にはprintfを使わない.
+
+char *outbuf;
+long outlen;
+long outcap;
+
+void out_reserve(long n) {
+  if (outlen + n <= outcap)
+    return;
+  long cap = outcap ? outcap : 64 * 1024;
+  while (cap < outlen + n)
+    cap *= 2;
+  outbuf = realloc(outbuf, cap);
+  if (!outbuf)
+    error("out of memory");
+  outcap = cap;
+}
+
+void out_mem(char *s, int len) {
+  out_reserve(len);
+  memcpy(outbuf + outlen, s, len);
+  outlen += len;
+}
+
+void out_str(char *s) { out_mem(s, strlen(s)); }
+
+void out_char(char c) {
+  out_reserve(1);
+  outbuf[outlen++] = c;
+}
+
+void out_int(long val) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  unsigned long u = val < 0 ? -(unsigned long)val : val;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (val < 0)
+    *--p = '-';
+  out_mem(p, buf + sizeof(buf) - p);
+}
+
+long output_len() { return outlen; }
+
+// バッファの内容を`path`に書き出す. `path`がNULLか"-"なら標準出力
+void write_output(char *path) {
+  int fd = 1;
+  if (path && strcmp(path, "-")) {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      error("cannot open %s: %s", path, strerror(errno));
+  }
+
+  for (long off = 0; off < outlen;) {
+    long n = write(fd, outbuf + off, outlen - off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      error("cannot write %s: %s", path ? path : "stdout", strerror(errno));
+    }
+    off += n;
+  }
+
+  if (fd != 1 && close(fd) < 0)
+    error("cannot write %s: %s", path, strerror(errno));
+}
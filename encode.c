@@ -0,0 +1,476 @@
+#include "poacc.h"
+
+#include <stdint.h>
+
+// x86-64の機械語へのエンコード
+//
+// 命令列を.textのバイト列に, グローバル変数と文字列リテラルを.bssと
+// .rodataに配置し, シンボルと再配置の表を作る. ELFファイルへの
+// 書き出しはelf.cで行う.
+//
+// 分岐は常に32ビットの相対アドレスでエンコードするので, 命令の長さは
+// ラベルの位置によらない. 関数内のラベルへの分岐は最後に書き込み,
+// シンボルへの参照と関数呼び出しは再配置として残す.
+
+Section sections[NSECTIONS] = {
+    [SEC_TEXT] = {".text", NULL, 0, 0, 16},
+    [SEC_DATA] = {".data", NULL, 0, 0, 1},
+    [SEC_BSS] = {".bss", NULL, 0, 0, 1},
+    [SEC_RODATA] = {".rodata", NULL, 0, 0, 1},
+};
+
+ObjSym *objsyms;
+Reloc *relocs;
+
+ObjSym **sym_buckets;
+int nsym_buckets;
+int nsyms;
+
+// ラベルへの分岐で, 後から相対アドレスを書き込む箇所
+typedef struct Fixup Fixup;
+struct Fixup {
+  Fixup *next;
+  long offset;
+  ObjSym *sym;
+};
+
+Fixup *fixups;
+
+unsigned hash_sym(char *name) {
+  return (unsigned)((uintptr_t)name >> 3) * 2654435761u;
+}
+
+void rehash_syms() {
+  int n = nsym_buckets ? nsym_buckets * 2 : 256;
+  ObjSym **b = calloc(n, sizeof(ObjSym *));
+
+  for (ObjSym *sym = objsyms; sym; sym = sym->older) {
+    int i = hash_sym(sym->name) & (n - 1);
+    sym->next = b[i];
+    b[i] = sym;
+  }
+
+  free(sym_buckets);
+  sym_buckets = b;
+  nsym_buckets = n;
+}
+
+// 名前`name`のシンボルを返す. なければ未定義のシンボルを作る
+ObjSym *get_sym(char *name) {
+  name = intern(name, strlen(name));
+  if (nsyms >= nsym_buckets)
+    rehash_syms();
+
+  ObjSym **bucket = &sym_buckets[hash_sym(name) & (nsym_buckets - 1)];
+  for (ObjSym *sym = *bucket; sym; sym = sym->next)
+    if (sym->name == name)
+      return sym;
+
+  ObjSym *sym = calloc(1, sizeof(ObjSym));
+  sym->name = name;
+  sym->next = *bucket;
+  *bucket = sym;
+  sym->older = objsyms;
+  objsyms = sym;
+  nsyms++;
+  return sym;
+}
+
+void define_sym(ObjSym *sym, SectionId sec, long offset) {
+  if (sym->sec != SEC_UNDEF)
+    error("%s: symbol already defined", sym->name);
+  sym->sec = sec;
+  sym->offset = offset;
+}
+
+//
+// セクションへの出力
+//
+
+void sec_reserve(Section *sec, long n) {
+  if (sec->size + n <= sec->cap)
+    return;
+  long cap = sec->cap ? sec->cap : 4096;
+  while (cap < sec->size + n)
+    cap *= 2;
+  sec->data = realloc(sec->data, cap);
+  if (!sec->data)
+    error("out of memory");
+  sec->cap = cap;
+}
+
+void sec_write(Section *sec, void *p, int n) {
+  sec_reserve(sec, n);
+  memcpy(sec->data + sec->size, p, n);
+  sec->size += n;
+}
+
+void sec_align(Section *sec, int align) {
+  if (sec->align < align)
+    sec->align = align;
+  long size = align_to(sec->size, align);
+  if (sec == &sections[SEC_BSS]) {
+    sec->size = size;
+    return;
+  }
+  sec_reserve(sec, size - sec->size);
+  memset(sec->data + sec->size, 0, size - sec->size);
+  sec->size = size;
+}
+
+Section *text = &sections[SEC_TEXT];
+
+void byte(int b) {
+  char c = b;
+  sec_write(text, &c, 1);
+}
+
+// x86-64はリトルエンディアン
+void imm(long val, int size) {
+  for (int i = 0; i < size; i++)
+    byte(val >> (i * 8));
+}
+
+void add_reloc(RelocType type, ObjSym *sym, long addend) {
+  Reloc *rel = calloc(1, sizeof(Reloc));
+  rel->offset = text->size;
+  rel->type = type;
+  rel->sym = sym;
+  rel->addend = addend;
+  rel->next = relocs;
+  relocs = rel;
+}
+
+bool fits_int8(long val) { return -128 <= val && val <= 127; }
+
+bool fits_int32(long val) { return INT32_MIN <= val && val <= INT32_MAX; }
+
+//
+// 命令のエンコード
+//
+
+// spl, bpl, sil, dilはREXプレフィックスがないとah, ch, dh, bhになる
+bool needs_rex8(Operand op) {
+  return op.kind == OPND_REG && op.size == 1 && RSP <= op.reg &&
+         op.reg <= RDI;
+}
+
+// REXプレフィックス, オペコード, ModR/Mと続くSIB, ディスプレースメントを
+// 出力する. `reg`はModR/Mのregフィールドに入るレジスタか/digitの値.
+// `opcode`が0xffより大きければ2バイトのオペコード.
+// `imm_size`はこの後に続く即値の大きさで, RIP相対の再配置に使う.
+void encode_rm(int size, int opcode, Operand reg, Operand rm, int imm_size) {
+  int rex = 0x40;
+  if (size == 8)
+    rex |= 8;
+  if (reg.kind == OPND_REG && reg.reg >= R8)
+    rex |= 4;
+  if (rm.kind == OPND_MEM && rm.scale && rm.index >= R8)
+    rex |= 2;
+  if ((rm.kind == OPND_REG || rm.kind == OPND_MEM) && rm.reg >= R8)
+    rex |= 1;
+  if (rex != 0x40 || needs_rex8(reg) || needs_rex8(rm))
+    byte(rex);
+
+  if (opcode > 0xff)
+    byte(opcode >> 8);
+  byte(opcode);
+
+  int r = (reg.kind == OPND_REG ? reg.reg : reg.val) & 7;
+
+  switch (rm.kind) {
+  case OPND_REG:
+    byte(0xc0 | r << 3 | (rm.reg & 7));
+    return;
+  case OPND_SYM:
+    byte(0x05 | r << 3);
+    add_reloc(RELOC_PC32, get_sym(rm.sym), rm.disp - 4 - imm_size);
+    imm(0, 4);
+    return;
+  case OPND_MEM: {
+    // rbpとr13を基底にするときはディスプレースメントを省略できない.
+    // rspとr12を基底にするときはSIBが必要.
+    int base = rm.reg & 7;
+    int mod;
+    if (rm.disp == 0 && base != RBP)
+      mod = 0;
+    else if (fits_int8(rm.disp))
+      mod = 1;
+    else
+      mod = 2;
+
+    // indexを使うときもSIBが必要
+    if (rm.scale) {
+      int ss = (rm.scale == 8) ? 3 : (rm.scale == 4) ? 2 : rm.scale - 1;
+      byte(mod << 6 | r << 3 | 4);
+      byte(ss << 6 | (rm.index & 7) << 3 | base);
+    } else {
+      byte(mod << 6 | r << 3 | base);
+      if (base == RSP)
+        byte(0x24);
+    }
+    if (mod == 1)
+      imm(rm.disp, 1);
+    else if (mod == 2)
+      imm(rm.disp, 4);
+    return;
+  }
+  }
+  error("invalid operand");
+}
+
+// /digitを持つ命令のregフィールド
+Operand digit(int n) { return imm_op(n); }
+
+int ccode[] = {[CC_E] = 0x4, [CC_NE] = 0x5, [CC_L] = 0xc,
+               [CC_LE] = 0xe, [CC_G] = 0xf, [CC_GE] = 0xd};
+
+void encode_mov(Operand dst, Operand src) {
+  if (src.kind == OPND_IMM) {
+    if (dst.kind == OPND_REG && dst.size == 8 && !fits_int32(src.val)) {
+      byte(0x48 | (dst.reg >= R8));
+      byte(0xb8 | (dst.reg & 7));
+      imm(src.val, 8);
+      return;
+    }
+    int size = dst.size == 1 ? 1 : 4;
+    encode_rm(dst.size, dst.size == 1 ? 0xc6 : 0xc7, digit(0), dst, size);
+    imm(src.val, size);
+    return;
+  }
+
+  if (src.kind == OPND_REG) {
+    encode_rm(src.size, src.size == 1 ? 0x88 : 0x89, src, dst, 0);
+    return;
+  }
+
+  assert(dst.kind == OPND_REG);
+  encode_rm(dst.size, dst.size == 1 ? 0x8a : 0x8b, dst, src, 0);
+}
+
+// add, sub, and, cmp
+void encode_alu(int op, Operand dst, Operand src) {
+  if (src.kind == OPND_IMM) {
+    if (dst.size == 1) {
+      encode_rm(1, 0x80, digit(op), dst, 1);
+      imm(src.val, 1);
+    } else if (fits_int8(src.val)) {
+      encode_rm(dst.size, 0x83, digit(op), dst, 1);
+      imm(src.val, 1);
+    } else {
+      encode_rm(dst.size, 0x81, digit(op), dst, 4);
+      imm(src.val, 4);
+    }
+    return;
+  }
+
+  if (src.kind == OPND_REG) {
+    encode_rm(src.size, op << 3 | (src.size == 1 ? 0x00 : 0x01), src, dst, 0);
+    return;
+  }
+
+  assert(dst.kind == OPND_REG);
+  encode_rm(dst.size, op << 3 | (dst.size == 1 ? 0x02 : 0x03), dst, src, 0);
+}
+
+void encode_imul(Operand dst, Operand src) {
+  assert(dst.kind == OPND_REG);
+  if (src.kind != OPND_IMM) {
+    encode_rm(dst.size, 0x0faf, dst, src, 0);
+    return;
+  }
+
+  // imul r, r, imm
+  if (fits_int8(src.val)) {
+    encode_rm(dst.size, 0x6b, dst, dst, 1);
+    imm(src.val, 1);
+  } else {
+    encode_rm(dst.size, 0x69, dst, dst, 4);
+    imm(src.val, 4);
+  }
+}
+
+void encode_jump(int opcode, char *label) {
+  if (opcode > 0xff)
+    byte(opcode >> 8);
+  byte(opcode);
+
+  Fixup *fix = calloc(1, sizeof(Fixup));
+  fix->offset = text->size;
+  fix->sym = get_sym(label);
+  fix->next = fixups;
+  fixups = fix;
+  imm(0, 4);
+}
+
+void encode_insn(Insn *insn) {
+  Operand dst = insn->dst;
+  Operand src = insn->src;
+
+  switch (insn->kind) {
+  case INSN_LABEL:
+    define_sym(get_sym(insn->label), SEC_TEXT, text->size);
+    return;
+  case INSN_MOV:
+    encode_mov(dst, src);
+    return;
+  case INSN_MOVSX:
+    if (src.size == 4)
+      encode_rm(dst.size, 0x63, dst, src, 0);
+    else
+      encode_rm(dst.size, src.size == 1 ? 0x0fbe : 0x0fbf, dst, src, 0);
+    return;
+  case INSN_MOVZX:
+    encode_rm(dst.size, src.size == 1 ? 0x0fb6 : 0x0fb7, dst, src, 0);
+    return;
+  case INSN_LEA:
+    encode_rm(8, 0x8d, dst, src, 0);
+    return;
+  case INSN_PUSH:
+    if (dst.kind == OPND_REG) {
+      if (dst.reg >= R8)
+        byte(0x41);
+      byte(0x50 | (dst.reg & 7));
+    } else if (dst.kind == OPND_IMM && fits_int8(dst.val)) {
+      byte(0x6a);
+      imm(dst.val, 1);
+    } else if (dst.kind == OPND_IMM) {
+      if (!fits_int32(dst.val))
+        error("push: immediate out of range: %ld", dst.val);
+      byte(0x68);
+      imm(dst.val, 4);
+    } else {
+      encode_rm(4, 0xff, digit(6), dst, 0);
+    }
+    return;
+  case INSN_POP:
+    assert(dst.kind == OPND_REG);
+    if (dst.reg >= R8)
+      byte(0x41);
+    byte(0x58 | (dst.reg & 7));
+    return;
+  case INSN_ADD:
+    encode_alu(0, dst, src);
+    return;
+  case INSN_SUB:
+    encode_alu(5, dst, src);
+    return;
+  case INSN_AND:
+    encode_alu(4, dst, src);
+    return;
+  case INSN_CMP:
+    encode_alu(7, dst, src);
+    return;
+  case INSN_IMUL:
+    if (src.kind == OPND_NONE)
+      encode_rm(8, 0xf7, digit(5), dst, 0);
+    else
+      encode_imul(dst, src);
+    return;
+  case INSN_NEG:
+    encode_rm(8, 0xf7, digit(3), dst, 0);
+    return;
+  case INSN_SHL:
+  case INSN_SAR:
+  case INSN_SHR: {
+    int op = (insn->kind == INSN_SHL) ? 4 : (insn->kind == INSN_SAR) ? 7 : 5;
+    encode_rm(8, 0xc1, digit(op), dst, 1);
+    imm(src.val, 1);
+    return;
+  }
+  case INSN_CQO:
+    byte(0x48);
+    byte(0x99);
+    return;
+  case INSN_IDIV:
+    encode_rm(dst.size, 0xf7, digit(7), dst, 0);
+    return;
+  case INSN_SETCC:
+    encode_rm(1, 0x0f90 | ccode[insn->cc], digit(0), dst, 0);
+    return;
+  case INSN_JMP:
+    // 関数名へのjmpは末尾呼び出し
+    if (strncmp(insn->label, ".L", 2)) {
+      byte(0xe9);
+      add_reloc(RELOC_PLT32, get_sym(insn->label), -4);
+      imm(0, 4);
+      return;
+    }
+    encode_jump(0xe9, insn->label);
+    return;
+  case INSN_JCC:
+    encode_jump(0x0f80 | ccode[insn->cc], insn->label);
+    return;
+  case INSN_CALL:
+    byte(0xe8);
+    add_reloc(RELOC_PLT32, get_sym(insn->label), -4);
+    imm(0, 4);
+    return;
+  case INSN_RET:
+    byte(0xc3);
+    return;
+  }
+  error("cannot encode instruction");
+}
+
+// ラベルへの分岐の相対アドレスを書き込む
+void resolve_fixups() {
+  for (Fixup *fix = fixups; fix; fix = fix->next) {
+    ObjSym *sym = fix->sym;
+    if (sym->sec != SEC_TEXT)
+      error("undefined label: %s", sym->name);
+    int rel = sym->offset - (fix->offset + 4);
+    memcpy(text->data + fix->offset, &rel, 4);
+  }
+}
+
+// 初期値のないグローバル変数を.bssに, 文字列リテラルを.rodataに置く.
+// 別の文字列リテラルの末尾と同じものはその中を指すシンボルにする.
+void assemble_data(Program *prog) {
+  Section *bss = &sections[SEC_BSS];
+  Section *rodata = &sections[SEC_RODATA];
+
+  for (VarList *vl = prog->globals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    if (var->contents) {
+      if (var->suffix_of)
+        continue;
+      define_sym(get_sym(var->name), SEC_RODATA, rodata->size);
+      sec_write(rodata, var->contents, var->cont_len);
+      continue;
+    }
+
+    sec_align(bss, align_of(var->ty));
+    define_sym(get_sym(var->name), SEC_BSS, bss->size);
+    bss->size += size_of(var->ty);
+  }
+
+  for (VarList *vl = prog->globals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    if (var->suffix_of) {
+      ObjSym *base = get_sym(var->suffix_of->name);
+      define_sym(get_sym(var->name), SEC_RODATA,
+                 base->offset + var->suffix_offset);
+    }
+  }
+}
+
+void assemble(Program *prog, Insn *insns) {
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    ObjSym *sym = get_sym(fn->name);
+    sym->is_global = true;
+    sym->is_func = true;
+  }
+
+  for (Insn *insn = insns; insn; insn = insn->next)
+    if (insn->kind != INSN_LABEL || insn->label)
+      encode_insn(insn);
+  resolve_fixups();
+
+  assemble_data(prog);
+
+  // 呼び出した関数のうち, 定義していないものは外部のシンボル
+  for (ObjSym *sym = objsyms; sym; sym = sym->older)
+    if (sym->sec == SEC_UNDEF)
+      sym->is_global = true;
+}
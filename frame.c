@@ -0,0 +1,99 @@
+#include "poacc.h"
+
+// ローカル変数のスタック上の配置
+//
+// スコープの区間[scope_begin, scope_end)が重ならない変数は同じ領域に置く.
+// 区間はブロックの入れ子に従うので, 変数を宣言順に積み, スコープを
+// 抜けた変数の領域を次の変数に使い回せばよい.
+//
+// アドレスを取られる変数がある関数では, ポインタ演算で隣の変数に届く
+// ことがあるので, 宣言順の並び (先に宣言したものほど低いアドレス) を
+// 保つ. そうでなければ変数はすべてスカラーなので, 8バイトの枠に
+// よく使うものから順にrbpに近い枠を割り当てる. rbpから128バイト以内なら
+// ディスプレースメントが1バイトで済む.
+
+bool scopes_overlap(Var *a, Var *b) {
+  return a->scope_begin < b->scope_end && b->scope_begin < a->scope_end;
+}
+
+// 始まりの順, 同じなら外側の区間を先にする
+int cmp_scope(const void *a, const void *b) {
+  Var *x = *(Var **)a;
+  Var *y = *(Var **)b;
+  if (x->scope_begin != y->scope_begin)
+    return x->scope_begin - y->scope_begin;
+  return y->scope_end - x->scope_end;
+}
+
+// 宣言順に下から積む. 領域の大きさを返す
+int layout_nested(Var **vars, int n) {
+  qsort(vars, n, sizeof(Var *), cmp_scope);
+
+  // いまスコープにある変数. offsetにはひとまず領域の下端からの位置を入れる
+  Var **stack = calloc(n + 1, sizeof(Var *));
+  int sp = 0;
+  int size = 0;
+  for (int i = 0; i < n; i++) {
+    Var *var = vars[i];
+    while (sp && stack[sp - 1]->scope_end <= var->scope_begin)
+      sp--;
+
+    int pos = 0;
+    if (sp)
+      pos = stack[sp - 1]->offset + size_of(stack[sp - 1]->ty);
+    pos = align_to(pos, align_of(var->ty));
+    var->offset = pos;
+    stack[sp++] = var;
+    if (size < pos + size_of(var->ty))
+      size = pos + size_of(var->ty);
+  }
+  free(stack);
+
+  // rbpは16バイト境界にあるので, 領域を8の倍数にすれば各変数も揃う
+  size = align_to(size, 8);
+  for (int i = 0; i < n; i++)
+    vars[i]->offset = size - vars[i]->offset;
+  return size;
+}
+
+// よく使う変数から順に, 区間の重なる変数がいないrbpに最も近い枠に置く
+int layout_slots(Var **vars, int n) {
+  qsort(vars, n, sizeof(Var *), cmp_weight);
+
+  int nslots = 0;
+  for (int i = 0; i < n; i++) {
+    int slot = 1;
+    for (int j = 0; j < i; j++) {
+      if (vars[j]->offset == slot * 8 && scopes_overlap(vars[i], vars[j])) {
+        slot++;
+        j = -1;
+      }
+    }
+    vars[i]->offset = slot * 8;
+    if (nslots < slot)
+      nslots = slot;
+  }
+  return nslots * 8;
+}
+
+// レジスタに置かない`fn`のローカル変数にrbpからのオフセットを決める
+void layout_frame(Function *fn) {
+  int n = 0;
+  for (VarList *vl = fn->locals; vl; vl = vl->next)
+    n++;
+  Var **vars = calloc(n + 1, sizeof(Var *));
+
+  bool flat = !count_uses(fn);
+  n = 0;
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    Var *var = vl->var;
+    if (var->is_promoted)
+      continue;
+    if (var->ty->kind == TY_ARRAY)
+      flat = false;
+    vars[n++] = var;
+  }
+
+  fn->stack_size = flat ? layout_slots(vars, n) : layout_nested(vars, n);
+  free(vars);
+}
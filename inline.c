@@ -0,0 +1,234 @@
+#include "poacc.h"
+
+// 小さな関数のインライン展開
+//
+// 本体が`return`で終わり, それ以外に`return`を含まない関数の呼び出しを
+// statement expressionに置き換える. 引数は新しいローカル変数に代入し,
+// 呼び出し先のローカル変数も呼び出し元の新しいローカル変数にする.
+//
+//   add2(a, b)  =>  ({ x' = a; y' = b; x' + y'; })
+//
+// 展開するのは本体のノード数がopt_inline_limit以下の関数だけで,
+// 展開したコードの中の呼び出しはさらに展開しない.
+
+int count_nodes(Node *node) {
+  if (!node)
+    return 0;
+
+  int n = 1 + count_nodes(node->lhs) + count_nodes(node->rhs) +
+          count_nodes(node->cond) + count_nodes(node->then) +
+          count_nodes(node->els) + count_nodes(node->init) +
+          count_nodes(node->inc);
+  for (Node *n2 = node->body; n2; n2 = n2->next)
+    n += count_nodes(n2);
+  for (Node *n2 = node->args; n2; n2 = n2->next)
+    n += count_nodes(n2);
+  return n;
+}
+
+bool has_return(Node *node) {
+  if (!node)
+    return false;
+  if (node->kind == NODE_RETURN)
+    return true;
+  if (has_return(node->lhs) || has_return(node->rhs) ||
+      has_return(node->cond) || has_return(node->then) ||
+      has_return(node->els) || has_return(node->init) ||
+      has_return(node->inc))
+    return true;
+  for (Node *n = node->body; n; n = n->next)
+    if (has_return(n))
+      return true;
+  return false;
+}
+
+bool can_inline(Function *fn) {
+  if (!fn->node)
+    return false;
+
+  int size = 0;
+  Node *last = fn->node;
+  for (Node *node = fn->node; node; node = node->next) {
+    size += count_nodes(node);
+    last = node;
+  }
+  if (size > opt_inline_limit || last->kind != NODE_RETURN)
+    return false;
+
+  for (Node *node = fn->node; node != last; node = node->next)
+    if (has_return(node))
+      return false;
+  if (has_return(last->lhs))
+    return false;
+
+  // 戻り値の型への切り詰めは呼び出し側の符号拡張に任せているので,
+  // 展開すると切り詰めが起きなくなる
+  if (size_of(last->lhs->ty) > size_of(fn->ty))
+    return false;
+
+  // 呼び出し元がローカル変数のアドレスを取る関数になると, 末尾呼び出しや
+  // 使用回数順のフレームの配置ができなくなる
+  return !takes_local_addr(fn);
+}
+
+// 展開中の呼び出し元と呼び出し, 呼び出し先の変数から新しい変数への対応
+Function *caller;
+Node *call;
+VarList *var_map_from;
+VarList *var_map_to;
+
+Var *map_var(Var *var) {
+  if (!var->is_local)
+    return var;
+
+  VarList *to = var_map_to;
+  for (VarList *from = var_map_from; from; from = from->next, to = to->next)
+    if (from->var == var)
+      return to->var;
+
+  Var *copy = arena_alloc(&ast_arena, sizeof(Var));
+  *copy = *var;
+  // 引数の評価中から展開した式の終わりまで生きている
+  copy->scope_begin = call->scope_begin;
+  copy->scope_end = call->scope_end;
+  VarList *vl = arena_alloc(&ast_arena, sizeof(VarList));
+  vl->var = copy;
+  vl->next = caller->locals;
+  caller->locals = vl;
+
+  VarList *f = arena_alloc(&ast_arena, sizeof(VarList));
+  f->var = var;
+  f->next = var_map_from;
+  var_map_from = f;
+  VarList *t = arena_alloc(&ast_arena, sizeof(VarList));
+  t->var = copy;
+  t->next = var_map_to;
+  var_map_to = t;
+  return copy;
+}
+
+Node *copy_node(Node *node) {
+  if (!node)
+    return NULL;
+
+  Node *copy = arena_alloc(&ast_arena, sizeof(Node));
+  nnodes++;
+  *copy = *node;
+  copy->next = NULL;
+  copy->lhs = copy_node(node->lhs);
+  copy->rhs = copy_node(node->rhs);
+  copy->cond = copy_node(node->cond);
+  copy->then = copy_node(node->then);
+  copy->els = copy_node(node->els);
+  copy->init = copy_node(node->init);
+  copy->inc = copy_node(node->inc);
+
+  Node head = {0};
+  Node *cur = &head;
+  for (Node *n = node->body; n; n = n->next)
+    cur = cur->next = copy_node(n);
+  copy->body = head.next;
+
+  head.next = NULL;
+  cur = &head;
+  for (Node *n = node->args; n; n = n->next)
+    cur = cur->next = copy_node(n);
+  copy->args = head.next;
+
+  if (node->kind == NODE_VAR)
+    copy->var = map_var(node->var);
+  return copy;
+}
+
+Function *find_function(Program *prog, char *name) {
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    if (fn->name == name)
+      return fn;
+  return NULL;
+}
+
+// 呼び出し`node`を`fn`の本体で置き換える
+void expand_call(Node *node, Function *fn) {
+  var_map_from = var_map_to = NULL;
+  call = node;
+
+  Node head = {0};
+  Node *cur = &head;
+
+  // 引数を仮引数の新しい変数に代入する
+  Node *arg = node->args;
+  for (VarList *vl = fn->params; vl; vl = vl->next, arg = arg->next) {
+    Node *var = new_node(NODE_VAR, arg->tok);
+    var->var = map_var(vl->var);
+    var->ty = vl->var->ty;
+    Node *assign = new_binary(NODE_ASSIGN, var, arg, arg->tok);
+    assign->ty = var->ty;
+    Node *stmt = new_node(NODE_EXPR_STMT, arg->tok);
+    stmt->lhs = assign;
+    cur = cur->next = stmt;
+  }
+
+  // 最後のreturnは式の値にする
+  for (Node *n = fn->node; n->next; n = n->next)
+    cur = cur->next = copy_node(n);
+  Node *last = fn->node;
+  while (last->next)
+    last = last->next;
+  cur->next = copy_node(last->lhs);
+
+  Node *next = node->next;
+  Type *ty = node->ty;
+  Token *tok = node->tok;
+  *node = (Node){0};
+  node->kind = NODE_STMT_EXPR;
+  node->body = head.next;
+  node->ty = ty;
+  node->tok = tok;
+  node->next = next;
+}
+
+void inline_calls(Program *prog, Node *node) {
+  if (!node)
+    return;
+
+  inline_calls(prog, node->lhs);
+  inline_calls(prog, node->rhs);
+  inline_calls(prog, node->cond);
+  inline_calls(prog, node->then);
+  inline_calls(prog, node->els);
+  inline_calls(prog, node->init);
+  inline_calls(prog, node->inc);
+  for (Node *n = node->body; n; n = n->next)
+    inline_calls(prog, n);
+  for (Node *n = node->args; n; n = n->next)
+    inline_calls(prog, n);
+
+  if (node->kind != NODE_FUNCALL)
+    return;
+
+  Function *fn = find_function(prog, node->funcname);
+  if (!fn || fn == caller || !can_inline(fn))
+    return;
+
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+  int nparams = 0;
+  for (VarList *vl = fn->params; vl; vl = vl->next)
+    nparams++;
+  if (nargs != nparams)
+    return;
+
+  expand_call(node, fn);
+}
+
+void inline_functions(Program *prog) {
+  if (opt_inline_limit <= 0)
+    return;
+
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    caller = fn;
+    for (Node *node = fn->node; node; node = node->next)
+      inline_calls(prog, node);
+  }
+}
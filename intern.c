@@ -0,0 +1,69 @@
+#include "poacc.h"
+
+// 識別子と文字列リテラルの中身のインターン
+//
+// 同じ内容の文字列には常に同じポインタを返すので, 名前の比較は
+// ポインタの比較で済む. 文字列はトークンを解放した後も変数名などとして
+// 使うのでstring_arenaに置く.
+
+typedef struct InternEntry InternEntry;
+struct InternEntry {
+  InternEntry *next;
+  char *str;
+  int len;
+  unsigned hash;
+};
+
+InternEntry **intern_buckets;
+int intern_nbuckets;
+int intern_nentries;
+
+unsigned hash_string(char *s, int len) {
+  // FNV-1a
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+void rehash_intern() {
+  int n = intern_nbuckets ? intern_nbuckets * 2 : 256;
+  InternEntry **b = calloc(n, sizeof(InternEntry *));
+
+  for (int i = 0; i < intern_nbuckets; i++) {
+    InternEntry *e = intern_buckets[i];
+    while (e) {
+      InternEntry *next = e->next;
+      e->next = b[e->hash & (n - 1)];
+      b[e->hash & (n - 1)] = e;
+      e = next;
+    }
+  }
+
+  free(intern_buckets);
+  intern_buckets = b;
+  intern_nbuckets = n;
+}
+
+// `s`から`len`バイトと同じ内容の, '\0'で終わる文字列を返す.
+// `s`は途中に'\0'を含んでいてもよい.
+char *intern(char *s, int len) {
+  if (intern_nentries >= intern_nbuckets)
+    rehash_intern();
+
+  unsigned h = hash_string(s, len);
+  InternEntry **bucket = &intern_buckets[h & (intern_nbuckets - 1)];
+  for (InternEntry *e = *bucket; e; e = e->next)
+    if (e->hash == h && e->len == len && !memcmp(e->str, s, len))
+      return e->str;
+
+  InternEntry *e = arena_alloc(&string_arena, sizeof(InternEntry));
+  e->str = arena_alloc(&string_arena, len + 1);
+  memcpy(e->str, s, len);
+  e->len = len;
+  e->hash = h;
+  e->next = *bucket;
+  *bucket = e;
+  intern_nentries++;
+  return e->str;
+}
@@ -0,0 +1,518 @@
+#include "poacc.h"
+
+// ASTからIRへの変換, IRのダンプと検査
+//
+// 式の値は仮想レジスタに置く. 式の一時値はASTの入れ子に沿って使われるので,
+// 仮想レジスタは定義より後ろ(ブロックを並べた順)でしか使われず,
+// ループの外で定義した値をループの中で使うこともない.
+// IRからx86-64への変換(irgen.c)はこの性質を前提にしている.
+
+Function *cur_fn;
+BasicBlock *cur_bb;
+BasicBlock *last_bb;
+int bbseq;
+
+BasicBlock *new_bb() {
+  BasicBlock *bb = arena_alloc(&ast_arena, sizeof(BasicBlock));
+  bb->id = bbseq++;
+  bb->label = format(".L.bb.%d", bb->id);
+  return bb;
+}
+
+// `bb`をブロックの列の末尾に置き, 以降の命令の追加先にする
+void start_bb(BasicBlock *bb) {
+  if (last_bb)
+    last_bb->next = bb;
+  else
+    cur_fn->bbs = bb;
+  last_bb = bb;
+  cur_bb = bb;
+}
+
+int new_vreg() { return ++cur_fn->nvregs; }
+
+IR *new_ir(IRKind kind) {
+  IR *ir = arena_alloc(&ast_arena, sizeof(IR));
+  ir->kind = kind;
+  if (cur_bb->last)
+    cur_bb->last->next = ir;
+  else
+    cur_bb->ir = ir;
+  cur_bb->last = ir;
+  return ir;
+}
+
+int emit_ir(IRKind kind, int a, int b) {
+  IR *ir = new_ir(kind);
+  ir->d = new_vreg();
+  ir->a = a;
+  ir->b = b;
+  return ir->d;
+}
+
+int emit_imm(long val) {
+  IR *ir = new_ir(IR_IMM);
+  ir->d = new_vreg();
+  ir->imm = val;
+  return ir->d;
+}
+
+void emit_jmp_ir(BasicBlock *bb) {
+  IR *ir = new_ir(IR_JMP);
+  ir->then = bb;
+}
+
+bool is_terminated() {
+  if (!cur_bb->last)
+    return false;
+  IRKind k = cur_bb->last->kind;
+  return k == IR_JMP || k == IR_BR || k == IR_RET;
+}
+
+// 終端命令の後ろに命令を足すときは, どこからも飛んでこない新しい
+// ブロックを始める
+void ensure_open_bb() {
+  if (is_terminated())
+    start_bb(new_bb());
+}
+
+int lower_expr(Node *node);
+void lower_stmt(Node *node);
+
+int lower_addr(Node *node) {
+  switch (node->kind) {
+  case NODE_VAR: {
+    IR *ir = new_ir(node->var->is_local ? IR_LVAR : IR_GVAR);
+    ir->d = new_vreg();
+    ir->var = node->var;
+    return ir->d;
+  }
+  case NODE_DEREF:
+    return lower_expr(node->lhs);
+  }
+  error_tok(node->tok, "not an lvalue");
+}
+
+int lower_load(int addr, Type *ty) {
+  IR *ir = new_ir(IR_LOAD);
+  ir->d = new_vreg();
+  ir->a = addr;
+  ir->size = size_of(ty);
+  return ir->d;
+}
+
+// 条件`cond`が真なら`then`へ, 偽なら`els`へ飛ぶ
+void lower_branch(Node *cond, BasicBlock *then, BasicBlock *els) {
+  if (cond->kind == NODE_NUM) {
+    emit_jmp_ir(cond->val ? then : els);
+    return;
+  }
+
+  int a = lower_expr(cond);
+  IR *ir = new_ir(IR_BR);
+  ir->a = a;
+  ir->then = then;
+  ir->els = els;
+}
+
+int lower_binary(IRKind kind, Node *node) {
+  int a = lower_expr(node->lhs);
+  if (node->rhs->kind == NODE_NUM) {
+    IR *ir = new_ir(kind);
+    ir->d = new_vreg();
+    ir->a = a;
+    ir->is_imm = true;
+    ir->imm = node->rhs->val;
+    return ir->d;
+  }
+  int b = lower_expr(node->rhs);
+  return emit_ir(kind, a, b);
+}
+
+int lower_expr(Node *node) {
+  switch (node->kind) {
+  case NODE_NUM:
+    return emit_imm(node->val);
+  case NODE_VAR:
+  case NODE_DEREF: {
+    int addr = (node->kind == NODE_VAR) ? lower_addr(node)
+                                        : lower_expr(node->lhs);
+    if (node->ty->kind == TY_ARRAY)
+      return addr;
+    return lower_load(addr, node->ty);
+  }
+  case NODE_ADDR:
+    return lower_addr(node->lhs);
+  case NODE_ASSIGN: {
+    int addr = lower_addr(node->lhs);
+    int val = lower_expr(node->rhs);
+    IR *ir = new_ir(IR_STORE);
+    ir->a = addr;
+    ir->b = val;
+    ir->size = size_of(node->ty);
+    return val;
+  }
+  case NODE_STMT_EXPR: {
+    Node *n = node->body;
+    for (; n->next; n = n->next)
+      lower_stmt(n);
+    ensure_open_bb();
+    return lower_expr(n);
+  }
+  case NODE_FUNCALL: {
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      nargs++;
+    int *args = arena_alloc(&ast_arena, sizeof(int) * (nargs ? nargs : 1));
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      args[i++] = lower_expr(arg);
+
+    IR *ir = new_ir(IR_CALL);
+    ir->d = new_vreg();
+    ir->funcname = node->funcname;
+    ir->args = args;
+    ir->nargs = nargs;
+    ir->size = size_of(node->ty);
+    return ir->d;
+  }
+  case NODE_ADD:
+    return lower_binary(IR_ADD, node);
+  case NODE_SUB:
+    return lower_binary(IR_SUB, node);
+  case NODE_MUL:
+    return lower_binary(IR_MUL, node);
+  case NODE_DIV:
+    return lower_binary(IR_DIV, node);
+  case NODE_EQ:
+    return lower_binary(IR_EQ, node);
+  case NODE_NE:
+    return lower_binary(IR_NE, node);
+  case NODE_LT:
+    return lower_binary(IR_LT, node);
+  case NODE_LE:
+    return lower_binary(IR_LE, node);
+  }
+  error_tok(node->tok, "invalid expression");
+}
+
+// 関数内でローカル変数のアドレスを取らないかどうか
+bool ir_tail_call_ok;
+
+// `return f(...);`が自分自身への末尾呼び出しなら, 新しい引数を仮引数に
+// 書き込んで先頭のブロックへ戻るループにする. 先頭のブロックは引数を
+// 仮引数に移した後から始まる
+bool lower_self_tail_call(Node *node) {
+  Node *call = node->lhs;
+  if (!opt_tail_call || !ir_tail_call_ok || call->kind != NODE_FUNCALL ||
+      call->funcname != cur_fn->name)
+    return false;
+
+  int nargs = 0;
+  Node *arg = call->args;
+  VarList *vl = cur_fn->params;
+  for (; arg && vl; arg = arg->next, vl = vl->next)
+    nargs++;
+  if (arg || vl)
+    return false;
+
+  // 引数はすべて評価してから書き込む. 引数が仮引数を読むことがある
+  int *args = arena_alloc(&ast_arena, sizeof(int) * (nargs ? nargs : 1));
+  int i = 0;
+  for (arg = call->args; arg; arg = arg->next)
+    args[i++] = lower_expr(arg);
+
+  i = 0;
+  for (vl = cur_fn->params; vl; vl = vl->next) {
+    IR *addr = new_ir(IR_LVAR);
+    addr->d = new_vreg();
+    addr->var = vl->var;
+    IR *ir = new_ir(IR_STORE);
+    ir->a = addr->d;
+    ir->b = args[i++];
+    ir->size = size_of(vl->var->ty);
+  }
+  emit_jmp_ir(cur_fn->bbs);
+  return true;
+}
+
+void lower_stmt(Node *node) {
+  ensure_open_bb();
+
+  switch (node->kind) {
+  case NODE_NULL:
+    return;
+  case NODE_EXPR_STMT:
+    lower_expr(node->lhs);
+    return;
+  case NODE_RETURN: {
+    if (lower_self_tail_call(node))
+      return;
+    int val = lower_expr(node->lhs);
+    IR *ir = new_ir(IR_RET);
+    ir->a = val;
+    return;
+  }
+  case NODE_IF: {
+    BasicBlock *then = new_bb();
+    BasicBlock *els = new_bb();
+    BasicBlock *end = node->els ? new_bb() : els;
+
+    lower_branch(node->cond, then, els);
+    start_bb(then);
+    lower_stmt(node->then);
+    ensure_open_bb();
+    emit_jmp_ir(end);
+    if (node->els) {
+      start_bb(els);
+      lower_stmt(node->els);
+      ensure_open_bb();
+      emit_jmp_ir(end);
+    }
+    start_bb(end);
+    return;
+  }
+  case NODE_WHILE:
+  case NODE_FOR: {
+    // 条件判定はループの末尾に置く
+    BasicBlock *body = new_bb();
+    BasicBlock *cond = new_bb();
+    BasicBlock *end = new_bb();
+
+    if (node->init)
+      lower_stmt(node->init);
+    ensure_open_bb();
+    emit_jmp_ir(node->cond ? cond : body);
+
+    start_bb(body);
+    lower_stmt(node->then);
+    if (node->inc)
+      lower_stmt(node->inc);
+    ensure_open_bb();
+    emit_jmp_ir(cond);
+
+    start_bb(cond);
+    if (node->cond)
+      lower_branch(node->cond, body, end);
+    else
+      emit_jmp_ir(body);
+    start_bb(end);
+    return;
+  }
+  case NODE_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      lower_stmt(n);
+    return;
+  }
+  error_tok(node->tok, "invalid statement");
+}
+
+void lower_ir(Program *prog) {
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    cur_fn = fn;
+    last_bb = NULL;
+    ir_tail_call_ok = !takes_local_addr(fn);
+    start_bb(new_bb());
+
+    for (Node *node = fn->node; node; node = node->next)
+      lower_stmt(node);
+
+    // 末尾まで来たら0を返す
+    if (!is_terminated()) {
+      int val = emit_imm(0);
+      IR *ir = new_ir(IR_RET);
+      ir->a = val;
+    }
+  }
+}
+
+//
+// ダンプ
+//
+
+char *ir_name[] = {
+    [IR_IMM] = "imm",   [IR_LVAR] = "lvar", [IR_GVAR] = "gvar",
+    [IR_LOAD] = "load", [IR_STORE] = "store", [IR_ADD] = "add",
+    [IR_SUB] = "sub",   [IR_MUL] = "mul",   [IR_DIV] = "div",
+    [IR_EQ] = "eq",     [IR_NE] = "ne",     [IR_LT] = "lt",
+    [IR_LE] = "le",     [IR_CALL] = "call", [IR_JMP] = "jmp",
+    [IR_BR] = "br",     [IR_RET] = "ret",
+};
+
+void out_vreg(int r) {
+  out_char('v');
+  out_int(r);
+}
+
+void dump_insn(IR *ir) {
+  out_str("  ");
+  if (ir->d) {
+    out_vreg(ir->d);
+    out_str(" = ");
+  }
+  out_str(ir_name[ir->kind]);
+
+  switch (ir->kind) {
+  case IR_IMM:
+    out_char(' ');
+    out_int(ir->imm);
+    break;
+  case IR_LVAR:
+  case IR_GVAR:
+    out_char(' ');
+    out_str(ir->var->name);
+    break;
+  case IR_LOAD:
+    out_int(ir->size * 8);
+    out_char(' ');
+    out_vreg(ir->a);
+    break;
+  case IR_STORE:
+    out_int(ir->size * 8);
+    out_char(' ');
+    out_vreg(ir->a);
+    out_str(", ");
+    out_vreg(ir->b);
+    break;
+  case IR_CALL:
+    out_char(' ');
+    out_str(ir->funcname);
+    out_char('(');
+    for (int i = 0; i < ir->nargs; i++) {
+      if (i)
+        out_str(", ");
+      out_vreg(ir->args[i]);
+    }
+    out_char(')');
+    break;
+  case IR_JMP:
+    out_str(" bb");
+    out_int(ir->then->id);
+    break;
+  case IR_BR:
+    out_char(' ');
+    out_vreg(ir->a);
+    out_str(", bb");
+    out_int(ir->then->id);
+    out_str(", bb");
+    out_int(ir->els->id);
+    break;
+  case IR_RET:
+    out_char(' ');
+    out_vreg(ir->a);
+    break;
+  default:
+    out_char(' ');
+    out_vreg(ir->a);
+    out_str(", ");
+    if (ir->is_imm)
+      out_int(ir->imm);
+    else
+      out_vreg(ir->b);
+  }
+  out_char('\n');
+}
+
+void dump_ir(Program *prog) {
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    out_str("function ");
+    out_str(fn->name);
+    out_str(" {\n");
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+      out_str("bb");
+      out_int(bb->id);
+      out_str(":\n");
+      for (IR *ir = bb->ir; ir; ir = ir->next)
+        dump_insn(ir);
+    }
+    out_str("}\n");
+  }
+}
+
+//
+// 検査
+//
+
+// IRの各命令が読む仮想レジスタを`uses`に入れ, その数を返す
+int ir_uses(IR *ir, int *uses) {
+  int n = 0;
+  switch (ir->kind) {
+  case IR_IMM:
+  case IR_LVAR:
+  case IR_GVAR:
+  case IR_JMP:
+    break;
+  case IR_CALL:
+    for (int i = 0; i < ir->nargs; i++)
+      uses[n++] = ir->args[i];
+    break;
+  case IR_LOAD:
+  case IR_BR:
+  case IR_RET:
+    uses[n++] = ir->a;
+    break;
+  default:
+    uses[n++] = ir->a;
+    if (!ir->is_imm)
+      uses[n++] = ir->b;
+  }
+  return n;
+}
+
+bool is_terminator(IR *ir) {
+  return ir->kind == IR_JMP || ir->kind == IR_BR || ir->kind == IR_RET;
+}
+
+bool has_bb(Function *fn, BasicBlock *target) {
+  for (BasicBlock *bb = fn->bbs; bb; bb = bb->next)
+    if (bb == target)
+      return true;
+  return false;
+}
+
+// IRの不変条件を確かめる. 破れていればコンパイラのバグ
+//
+// - 各ブロックは終端命令(jmp, br, ret)でちょうど1回終わる
+// - 分岐先は同じ関数のブロック
+// - 仮想レジスタはちょうど1回定義され, 定義より後ろでだけ使われる
+void verify_ir(Program *prog) {
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    bool *defined = calloc(fn->nvregs + 1, sizeof(bool));
+    int *uses = malloc(sizeof(int) * 8);
+    int ucap = 8;
+
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+      if (!bb->ir || !is_terminator(bb->last))
+        error("ir: %s: bb%d has no terminator", fn->name, bb->id);
+
+      for (IR *ir = bb->ir; ir; ir = ir->next) {
+        if (is_terminator(ir) && ir != bb->last)
+          error("ir: %s: bb%d: terminator in the middle", fn->name, bb->id);
+        if ((ir->kind == IR_JMP || ir->kind == IR_BR) &&
+            !has_bb(fn, ir->then))
+          error("ir: %s: bb%d: invalid branch target", fn->name, bb->id);
+        if (ir->kind == IR_BR && !has_bb(fn, ir->els))
+          error("ir: %s: bb%d: invalid branch target", fn->name, bb->id);
+
+        if (ir->kind == IR_CALL && ir->nargs > ucap) {
+          ucap = ir->nargs;
+          uses = realloc(uses, sizeof(int) * ucap);
+        }
+        int n = ir_uses(ir, uses);
+        for (int i = 0; i < n; i++)
+          if (uses[i] <= 0 || uses[i] > fn->nvregs || !defined[uses[i]])
+            error("ir: %s: bb%d: v%d used before definition", fn->name,
+                  bb->id, uses[i]);
+
+        if (ir->d) {
+          if (ir->d > fn->nvregs || defined[ir->d])
+            error("ir: %s: bb%d: v%d defined twice", fn->name, bb->id,
+                  ir->d);
+          defined[ir->d] = true;
+        }
+      }
+    }
+    free(defined);
+    free(uses);
+  }
+}
@@ -0,0 +1,326 @@
+#include "poacc.h"
+
+// IRからx86-64の命令列への変換
+//
+// 仮想レジスタはブロックを並べた順での定義から最後の使用までを生存区間とし,
+// linear scanで物理レジスタに割り当てる. ir.cの作るIRでは値がループを
+// またいで使われないので, この区間で生存範囲を覆える. 関数呼び出しを
+// またぐ区間にはcallee-savedなレジスタだけを使い, 足りなければスタックに
+// spillする.
+
+// 割り当てに使うレジスタ. caller-savedなものを先に使う
+Reg irreg[] = {R10, R11, RBX, R12, R13, R14, R15};
+#define NIRREG (sizeof(irreg) / sizeof(*irreg))
+
+typedef struct {
+  int start;  // 定義の位置
+  int end;    // 最後に使われる位置
+  int nuses;
+  bool spill; // trueならslotに置く
+  Reg reg;
+  int slot; // rbpからのオフセット
+} Interval;
+
+Interval *iv;
+int *calls; // 関数呼び出しの位置
+int ncalls;
+char *ir_funcname;
+
+bool crosses_call(Interval *it) {
+  for (int i = 0; i < ncalls; i++)
+    if (it->start < calls[i] && calls[i] < it->end)
+      return true;
+  return false;
+}
+
+// 生存区間を求め, レジスタを割り当てる. spill用の領域の大きさを返す
+int alloc_regs(Function *fn, bool *used) {
+  iv = calloc(fn->nvregs + 1, sizeof(Interval));
+  int ninsn = 0;
+  for (BasicBlock *bb = fn->bbs; bb; bb = bb->next)
+    for (IR *ir = bb->ir; ir; ir = ir->next)
+      ninsn++;
+  calls = calloc(ninsn + 1, sizeof(int));
+  ncalls = 0;
+
+  int *uses = NULL;
+  int ucap = 0;
+  int pos = 0;
+  for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next, pos++) {
+      if (ucap < ir->nargs + 2) {
+        ucap = ir->nargs + 2;
+        uses = realloc(uses, sizeof(int) * ucap);
+      }
+      int n = ir_uses(ir, uses);
+      for (int i = 0; i < n; i++) {
+        iv[uses[i]].end = pos;
+        iv[uses[i]].nuses++;
+      }
+      if (ir->d)
+        iv[ir->d].start = iv[ir->d].end = pos;
+      if (ir->kind == IR_CALL)
+        calls[ncalls++] = pos;
+    }
+  }
+  free(uses);
+
+  // 仮想レジスタは定義順に番号が振られているとは限らないので,
+  // 命令の順にたどって割り当てる
+  int owner[NIRREG] = {0}; // そのレジスタを使っている仮想レジスタ
+  int nslot = 0;
+
+  for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+    for (IR *ir = bb->ir; ir; ir = ir->next) {
+      if (!ir->d)
+        continue;
+      Interval *it = &iv[ir->d];
+
+      // 区間の終わった仮想レジスタのレジスタを空ける
+      for (int i = 0; i < NIRREG; i++)
+        if (owner[i] && iv[owner[i]].end < it->start)
+          owner[i] = 0;
+
+      bool cross = crosses_call(it);
+      int found = -1;
+
+      // 2項演算の左辺がここで死ぬなら, 同じレジスタを使えばmovが要らない
+      if (ir->kind == IR_ADD || ir->kind == IR_SUB || ir->kind == IR_MUL) {
+        Interval *a = &iv[ir->a];
+        for (int i = 0; i < NIRREG; i++)
+          if (owner[i] == ir->a && a->end == it->start &&
+              (!cross || is_callee_saved(irreg[i])))
+            found = i;
+      }
+
+      for (int i = 0; i < NIRREG && found < 0; i++)
+        if (!owner[i] && (!cross || is_callee_saved(irreg[i])))
+          found = i;
+
+      if (found < 0) {
+        it->spill = true;
+        it->slot = fn->stack_size + (++nslot) * 8;
+        continue;
+      }
+      owner[found] = ir->d;
+      it->reg = irreg[found];
+      used[found] = true;
+    }
+  }
+  return nslot * 8;
+}
+
+Operand vop(int v) {
+  if (iv[v].spill)
+    return mem_op(RBP, -iv[v].slot, 8);
+  return reg_op(iv[v].reg);
+}
+
+// 仮想レジスタ`v`をレジスタで使う. spillされていれば`scratch`に読み込む
+Reg use_reg(int v, Reg scratch) {
+  if (!iv[v].spill)
+    return iv[v].reg;
+  emit2(INSN_MOV, reg_op(scratch), vop(v));
+  return scratch;
+}
+
+// 仮想レジスタ`v`の値を作るレジスタ. spillされていればraxで作ってから
+// def_done()で書き戻す
+Reg def_reg(int v) { return iv[v].spill ? RAX : iv[v].reg; }
+
+void def_done(int v) {
+  if (iv[v].spill)
+    emit2(INSN_MOV, vop(v), reg_op(RAX));
+}
+
+bool is_ir_compare(IR *ir) {
+  return ir->kind == IR_EQ || ir->kind == IR_NE || ir->kind == IR_LT ||
+         ir->kind == IR_LE;
+}
+
+CondCode ir_cc(IRKind kind) {
+  switch (kind) {
+  case IR_EQ:
+    return CC_E;
+  case IR_NE:
+    return CC_NE;
+  case IR_LT:
+    return CC_L;
+  default:
+    return CC_LE;
+  }
+}
+
+Operand rhs_op(IR *ir) { return ir->is_imm ? imm_op(ir->imm) : vop(ir->b); }
+
+void gen_cmp(IR *ir) {
+  Operand a = vop(ir->a);
+  // 両方がメモリにあればaをレジスタに読み込む
+  if (a.kind == OPND_MEM && (ir->is_imm ? false : iv[ir->b].spill))
+    a = reg_op(use_reg(ir->a, RAX));
+  emit2(INSN_CMP, a, rhs_op(ir));
+}
+
+void gen_ir(IR *ir) {
+  switch (ir->kind) {
+  case IR_IMM: {
+    Reg r = def_reg(ir->d);
+    emit2(INSN_MOV, reg_op(r), imm_op(ir->imm));
+    def_done(ir->d);
+    return;
+  }
+  case IR_LVAR:
+  case IR_GVAR: {
+    Reg r = def_reg(ir->d);
+    if (ir->kind == IR_LVAR)
+      emit2(INSN_LEA, reg_op(r), mem_op(RBP, -ir->var->offset, 8));
+    else
+      emit2(INSN_LEA, reg_op(r), sym_op(ir->var->name));
+    def_done(ir->d);
+    return;
+  }
+  case IR_LOAD: {
+    Reg a = use_reg(ir->a, RAX);
+    Reg r = def_reg(ir->d);
+    if (ir->size == 8)
+      emit2(INSN_MOV, reg_op(r), mem_op(a, 0, 8));
+    else
+      emit2(INSN_MOVSX, reg_op(r), mem_op(a, 0, ir->size));
+    def_done(ir->d);
+    return;
+  }
+  case IR_STORE: {
+    Reg a = use_reg(ir->a, RAX);
+    Reg b = use_reg(ir->b, RDI);
+    emit2(INSN_MOV, mem_op(a, 0, ir->size), sized_reg_op(b, ir->size));
+    return;
+  }
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL: {
+    Reg r = def_reg(ir->d);
+    Operand a = vop(ir->a);
+    if (!same_op(a, reg_op(r)))
+      emit2(INSN_MOV, reg_op(r), a);
+    InsnKind op = (ir->kind == IR_ADD)   ? INSN_ADD
+                  : (ir->kind == IR_SUB) ? INSN_SUB
+                                         : INSN_IMUL;
+    emit2(op, reg_op(r), rhs_op(ir));
+    def_done(ir->d);
+    return;
+  }
+  case IR_DIV:
+    emit2(INSN_MOV, reg_op(RAX), vop(ir->a));
+    emit0(INSN_CQO);
+    if (ir->is_imm) {
+      emit2(INSN_MOV, reg_op(RDI), imm_op(ir->imm));
+      emit1(INSN_IDIV, reg_op(RDI));
+    } else {
+      emit1(INSN_IDIV, vop(ir->b));
+    }
+    if (!iv[ir->d].spill)
+      emit2(INSN_MOV, reg_op(iv[ir->d].reg), reg_op(RAX));
+    def_done(ir->d);
+    return;
+  case IR_EQ:
+  case IR_NE:
+  case IR_LT:
+  case IR_LE: {
+    gen_cmp(ir);
+
+    // 直後の分岐でしか使わなければ, 値を作らずにそのまま分岐する
+    IR *br = ir->next;
+    if (br && br->kind == IR_BR && br->a == ir->d && iv[ir->d].nuses == 1) {
+      emit_jcc(ir_cc(ir->kind), br->then->label);
+      emit_jmp(br->els->label);
+      return;
+    }
+
+    Reg r = def_reg(ir->d);
+    emit_setcc(ir_cc(ir->kind), r);
+    emit2(INSN_MOVZX, reg_op(r), reg8_op(r));
+    def_done(ir->d);
+    return;
+  }
+  case IR_CALL: {
+    for (int i = 0; i < ir->nargs; i++)
+      emit2(INSN_MOV, reg_op(argreg[i]), vop(ir->args[i]));
+    emit2(INSN_MOV, reg_op(RAX), imm_op(0));
+    emit_call(ir->funcname);
+    if (ir->size < 8)
+      emit2(INSN_MOVSX, reg_op(RAX), sized_reg_op(RAX, ir->size));
+    if (!iv[ir->d].spill)
+      emit2(INSN_MOV, reg_op(iv[ir->d].reg), reg_op(RAX));
+    def_done(ir->d);
+    return;
+  }
+  case IR_JMP:
+    emit_jmp(ir->then->label);
+    return;
+  case IR_BR:
+    // 比較と融合した分岐は比較の側で出力済み
+    if (cursor->kind == INSN_JMP && cursor->label == ir->els->label)
+      return;
+    emit2(INSN_CMP, vop(ir->a), imm_op(0));
+    emit_jcc(CC_NE, ir->then->label);
+    emit_jmp(ir->els->label);
+    return;
+  case IR_RET:
+    emit2(INSN_MOV, reg_op(RAX), vop(ir->a));
+    emit_jmp(format(".Lreturn.%s", ir_funcname));
+    return;
+  }
+  error("cannot generate IR instruction");
+}
+
+void gen_ir_text(Program *prog) {
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    emit_label(fn->name);
+    ir_funcname = fn->name;
+    Insn *entry = cursor;
+
+    bool used[NIRREG] = {0};
+    int spill_size = alloc_regs(fn, used);
+    int locals = fn->stack_size + spill_size;
+
+    Reg saved[NIRREG];
+    int nsave = 0;
+    for (int i = 0; i < NIRREG; i++)
+      if (used[i] && is_callee_saved(irreg[i]))
+        saved[nsave++] = irreg[i];
+
+    int i = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+      load_arg(vl->var, i++);
+
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+      emit_label(bb->label);
+      for (IR *ir = bb->ir; ir; ir = ir->next)
+        gen_ir(ir);
+    }
+
+    // Epilogue
+    emit_label(format(".Lreturn.%s", fn->name));
+    for (int i = 0; i < nsave; i++)
+      emit2(INSN_MOV, reg_op(saved[i]), mem_op(RBP, -(locals + (i + 1) * 8), 8));
+    emit2(INSN_MOV, reg_op(RSP), reg_op(RBP));
+    emit1(INSN_POP, reg_op(RBP));
+    emit0(INSN_RET);
+    Insn *end = cursor;
+
+    // Prologue
+    cursor = entry;
+    emit1(INSN_PUSH, reg_op(RBP));
+    emit2(INSN_MOV, reg_op(RBP), reg_op(RSP));
+    emit2(INSN_SUB, reg_op(RSP), imm_op(align_to(locals + nsave * 8, 16)));
+    for (int i = 0; i < nsave; i++)
+      emit2(INSN_MOV, mem_op(RBP, -(locals + (i + 1) * 8), 8), reg_op(saved[i]));
+    cursor = end;
+
+    free(iv);
+    free(calls);
+  }
+
+  if (opt_peephole)
+    peephole(insns);
+}
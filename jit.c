@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+#include "poacc.h"
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// `--run`: assemble()で作ったコードをメモリ上に配置して実行できるようにする
+//
+// .text, .rodata, .bssをページ境界に揃えて1つの領域に並べ,
+// 再配置を直接書き込む. 外部の関数はdlsym()で探すが, 32ビットの
+// 相対アドレスでは届かないかもしれないので, .textの後ろに置いた
+// `jmp [rip+0]`とアドレスからなるスタブを経由して呼ぶ.
+
+#define STUB_SIZE 16
+
+void *sym_addr(ObjSym *sym, char **base) {
+  if (sym->sec == SEC_UNDEF)
+    return sym->addr;
+  return base[sym->sec] + sym->offset;
+}
+
+// 配置したmain関数のアドレスを返す
+void *jit_link() {
+  long page = sysconf(_SC_PAGESIZE);
+
+  int nstub = 0;
+  for (ObjSym *sym = objsyms; sym; sym = sym->older)
+    if (sym->sec == SEC_UNDEF)
+      nstub++;
+
+  long stub_off = align_to(sections[SEC_TEXT].size, 16);
+  long len[NSECTIONS] = {
+      [SEC_TEXT] = align_to(stub_off + nstub * STUB_SIZE, page),
+      [SEC_DATA] = align_to(sections[SEC_DATA].size, page),
+      [SEC_BSS] = align_to(sections[SEC_BSS].size, page),
+      [SEC_RODATA] = align_to(sections[SEC_RODATA].size, page),
+  };
+
+  long total = 0;
+  for (int i = SEC_TEXT; i < NSECTIONS; i++)
+    total += len[i];
+
+  char *mem = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    error("mmap: %s", strerror(errno));
+
+  char *base[NSECTIONS] = {0};
+  char *p = mem;
+  for (int i = SEC_TEXT; i < NSECTIONS; i++) {
+    base[i] = p;
+    if (sections[i].data)
+      memcpy(p, sections[i].data, sections[i].size);
+    p += len[i];
+  }
+
+  // 外部の関数へのスタブ: jmp [rip+0]; .quad addr
+  char *stub = base[SEC_TEXT] + stub_off;
+  for (ObjSym *sym = objsyms; sym; sym = sym->older) {
+    if (sym->sec != SEC_UNDEF)
+      continue;
+    void *addr = dlsym(RTLD_DEFAULT, sym->name);
+    if (!addr)
+      error("undefined symbol: %s", sym->name);
+    memcpy(stub, "\xff\x25\x00\x00\x00\x00", 6);
+    memcpy(stub + 6, &addr, 8);
+    sym->addr = stub;
+    stub += STUB_SIZE;
+  }
+
+  for (Reloc *rel = relocs; rel; rel = rel->next) {
+    char *loc = base[SEC_TEXT] + rel->offset;
+    long val = (char *)sym_addr(rel->sym, base) + rel->addend - loc;
+    if (val < INT32_MIN || INT32_MAX < val)
+      error("relocation out of range: %s", rel->sym->name);
+    int32_t v = val;
+    memcpy(loc, &v, 4);
+  }
+
+  if (mprotect(base[SEC_TEXT], len[SEC_TEXT], PROT_READ | PROT_EXEC) ||
+      (len[SEC_RODATA] &&
+       mprotect(base[SEC_RODATA], len[SEC_RODATA], PROT_READ)))
+    error("mprotect: %s", strerror(errno));
+
+  ObjSym *main_sym = get_sym("main");
+  if (main_sym->sec != SEC_TEXT)
+    error("main is not defined");
+
+  return sym_addr(main_sym, base);
+}
@@ -1,49 +1,328 @@
+#define _GNU_SOURCE
 #include "poacc.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ファイルの末尾が"\n\0"になるようにする. `buf`には`size + 2`バイト以上の
+// 領域があり, `buf[size]`以降は0で埋まっていること.
+char *terminate(char *buf, long size) {
+  if (size == 0 || buf[size - 1] != '\n')
+    buf[size] = '\n';
+  return buf;
+}
+
+// パイプなど大きさが分からない入力を読む
+char *read_stream(FILE *fp, char *path) {
+  long cap = 64 * 1024;
+  long size = 0;
+  char *buf = malloc(cap);
+
+  for (;;) {
+    if (cap - size < 2) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+      if (!buf)
+        error("%s: out of memory", path);
+    }
+    long n = fread(buf + size, 1, cap - size - 2, fp);
+    size += n;
+    if (n == 0)
+      break;
+  }
+  if (ferror(fp))
+    error("cannot read %s: %s", path, strerror(errno));
+
+  buf[size] = buf[size + 1] = '\0';
+  return terminate(buf, size);
+}
+
+// 通常のファイルは読み込まずにメモリにマップする.
+//
+// ファイルの後ろに少なくとも2バイトの0が続くように, 先に1ページ多く
+// 無名の領域を確保してからその先頭にファイルを重ねてマップする.
+// 末尾に'\n'を書き込むときはプライベートなマップなので, そのページだけが
+// コピーされる.
+char *map_file(int fd, long size) {
+  long page = sysconf(_SC_PAGESIZE);
+  // align_to()はintなので, 2GiBを超えるファイルのためにlongで切り上げる
+  long len = (size + 2 + page - 1) / page * page;
+
+  char *buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    return NULL;
+  if (mmap(buf, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+           0) == MAP_FAILED) {
+    munmap(buf, len);
+    return NULL;
+  }
+  return terminate(buf, size);
+}
+
 // Returns the contents of a given file.
 char *read_file(char *path) {
   // Open and read the file.
   FILE *fp = fopen(path, "r");
   if (!fp)
     error("cannot open %s: %s", path, strerror(errno));
-  int filemax = 10 * 1024 * 1024;
-  char *buf = malloc(filemax);
-  int size = fread(buf, 1, filemax - 2, fp);
-  if (!feof(fp))
-    error("%s: file too large");
-  // Make sure that the string ends with "\n\0".
-  if (size == 0 || buf[size - 1] != '\n')
-    buf[size++] = '\n';
-  buf[size] = '\0';
+
+  struct stat st;
+  char *buf = NULL;
+  if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    buf = map_file(fileno(fp), st.st_size);
+  if (!buf)
+    buf = read_stream(fp, path);
+
+  fclose(fp);
   return buf;
 }
 
 int align_to(int n, int align) { return (n + align - 1) & ~(align - 1); }
 
-int main(int argc, char **argv) {
-  if (argc != 2)
+// 式の一時値をレジスタに割り当てるかどうか.
+// `-fno-regalloc`で従来のpush/popによるスタックマシンに戻す.
+bool opt_regalloc = true;
+
+// アドレスを取られないローカル変数をレジスタに置くかどうか.
+// `-fno-mem2reg`で常にスタックに置く.
+bool opt_mem2reg = true;
+
+// `-fomit-frame-pointer`: rbpをフレームポインタに使わず,
+// ローカル変数をrspからの相対で参照する
+bool opt_omit_frame_pointer;
+
+// `return f(...);`を呼び出し先へのjmpにするかどうか.
+// 自分自身への末尾呼び出しはループになる.
+bool opt_tail_call = true;
+
+// `-finline-limit=<n>`: インライン展開する関数の本体のノード数の上限.
+// `-fno-inline`か0なら展開しない.
+int opt_inline_limit = 20;
+
+// 出力する命令列にpeephole最適化をかけるかどうか.
+// `-fno-peephole=<rule>`で個別のルールだけを止められる.
+bool opt_peephole = true;
+
+// `--stats`: 最適化とメモリ確保の統計を標準エラー出力に出す
+bool opt_stats;
+
+// `-ffree-tokens`: 意味解析が済んだらトークンのアリーナを解放する
+bool opt_free_tokens;
+
+// `-ftime-report`: フェーズごとの時間とメモリを標準エラー出力に出す.
+// `-ftime-report=json`ならJSONで出す.
+bool opt_time_report;
+bool opt_time_report_json;
+
+// `-c`: アセンブリではなくELFのオブジェクトファイルを出力する
+bool opt_emit_obj;
+
+// `--run`: 出力せずにメモリ上でmain関数を実行する
+bool opt_run;
+
+// `-fir`: ASTからではなく, 基本ブロック単位のIRを経由してコードを生成する
+bool opt_ir;
+
+// `--dump-ir`: IRを出力して終わる
+bool opt_dump_ir;
+
+// `-o <path>`: 出力先. 指定しなければ標準出力
+char *outpath;
+
+// `--tokenize-only`: トークン分割だけをして終わる. 字句解析のベンチマーク用
+bool opt_tokenize_only;
+
+void parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-fregalloc")) {
+      opt_regalloc = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-regalloc")) {
+      opt_regalloc = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fmem2reg")) {
+      opt_mem2reg = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-mem2reg")) {
+      opt_mem2reg = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fomit-frame-pointer")) {
+      opt_omit_frame_pointer = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-omit-frame-pointer")) {
+      opt_omit_frame_pointer = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "-ftail-call")) {
+      opt_tail_call = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-tail-call")) {
+      opt_tail_call = false;
+      continue;
+    }
+    if (!strncmp(argv[i], "-finline-limit=", 15)) {
+      opt_inline_limit = atoi(argv[i] + 15);
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-inline")) {
+      opt_inline_limit = 0;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fpeephole")) {
+      opt_peephole = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-peephole")) {
+      opt_peephole = false;
+      continue;
+    }
+    if (!strncmp(argv[i], "-fno-peephole=", 14)) {
+      if (!disable_peephole_rule(argv[i] + 14))
+        error("unknown peephole rule: %s", argv[i] + 14);
+      continue;
+    }
+    if (!strcmp(argv[i], "-ffree-tokens")) {
+      opt_free_tokens = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-free-tokens")) {
+      opt_free_tokens = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "-c")) {
+      opt_emit_obj = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--run")) {
+      opt_run = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fir")) {
+      opt_ir = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-ir")) {
+      opt_ir = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "--dump-ir")) {
+      opt_dump_ir = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-o")) {
+      if (++i == argc)
+        error("missing filename after '-o'");
+      outpath = argv[i];
+      continue;
+    }
+    if (!strncmp(argv[i], "-o", 2)) {
+      outpath = argv[i] + 2;
+      continue;
+    }
+    if (!strcmp(argv[i], "-ftime-report")) {
+      opt_time_report = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-ftime-report=json")) {
+      opt_time_report = true;
+      opt_time_report_json = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--tokenize-only")) {
+      opt_tokenize_only = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--stats")) {
+      opt_stats = true;
+      continue;
+    }
+    if (argv[i][0] == '-' && argv[i][1] != '\0')
+      error("unknown argument: %s", argv[i]);
+    if (filename)
+      error("%s: invalid number of arguments", argv[0]);
+    filename = argv[i];
+  }
+
+  if (!filename)
     error("%s: invalid number of arguments", argv[0]);
+}
+
+int main(int argc, char **argv) {
+  parse_args(argc, argv);
 
   // Tokenize and parse.
-  filename = argv[1];
-  user_input = read_file(argv[1]);
+  phase_begin();
+  user_input = read_file(filename);
+  phase_end("read");
+
+  phase_begin();
   token = tokenize();
+  phase_end("tokenize");
+  if (opt_tokenize_only) {
+    if (opt_time_report)
+      print_time_report();
+    return 0;
+  }
+
+  phase_begin();
   Program *prog = program();
+  phase_end("parse");
+
+  phase_begin();
   add_type(prog);
+  phase_end("type");
 
-  // Assign offsets to local variables.
-  for (Function *fn = prog->fns; fn; fn = fn->next) {
-    int offset = 0;
-    for (VarList *vl = fn->locals; vl; vl = vl->next) {
-      Var *var = vl->var;
-      offset += size_of(var->ty);
-      var->offset = offset;
-    }
-    fn->stack_size = align_to(offset, 8);
+  // 以降はトークンを参照しない
+  if (opt_free_tokens) {
+    arena_free(&token_arena);
+    token = NULL;
   }
 
+  phase_begin();
+  inline_functions(prog);
+  phase_end("inline");
+
+  phase_begin();
+  optimize(prog);
+  phase_end("optimize");
+
+  // Assign offsets to local variables.
+  phase_begin();
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    layout_frame(fn);
+  phase_end("layout");
+
   // Traverse the AST to emit assembly.
+  phase_begin();
   codegen(prog);
+  phase_end("codegen");
+
+  int (*main_fn)() = NULL;
+  phase_begin();
+  if (opt_run)
+    main_fn = jit_link();
+  else
+    write_output(outpath);
+  phase_end(opt_run ? "link" : "write");
+
+  if (opt_stats) {
+    if (opt_peephole)
+      print_peephole_stats();
+    print_arena_stats();
+  }
+  if (opt_time_report)
+    print_time_report();
 
+  // exit()で標準出力をフラッシュする
+  if (opt_run)
+    exit(main_fn());
   return 0;
 }
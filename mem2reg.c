@@ -0,0 +1,105 @@
+#include "poacc.h"
+
+// ローカル変数のレジスタへの昇格 (mem2reg)
+//
+// アドレスを取られないスカラーのローカル変数は, スタック上の領域の代わりに
+// レジスタに置く. 使うレジスタはgen_text()が関数ごとに選ぶ.
+// アドレスを取られる変数と配列はメモリに置いたままにする.
+
+// 関数内でどれか1つでもローカル変数のアドレスを取られるかどうか
+bool addr_taken;
+
+void mark_addr_taken(Var *var) {
+  var->addr_taken = true;
+  addr_taken = true;
+}
+
+void scan_uses(Node *node, int loop_depth) {
+  if (!node)
+    return;
+
+  switch (node->kind) {
+  case NODE_VAR:
+    if (node->var->is_local) {
+      if (node->ty->kind == TY_ARRAY)
+        mark_addr_taken(node->var);
+      node->var->weight += 1L << (3 * (loop_depth < 4 ? loop_depth : 4));
+    }
+    return;
+  case NODE_ADDR:
+    if (node->lhs->kind == NODE_VAR && node->lhs->var->is_local)
+      mark_addr_taken(node->lhs->var);
+    break;
+  case NODE_WHILE:
+  case NODE_FOR:
+    scan_uses(node->init, loop_depth);
+    loop_depth++;
+    scan_uses(node->cond, loop_depth);
+    scan_uses(node->then, loop_depth);
+    scan_uses(node->inc, loop_depth);
+    return;
+  }
+
+  scan_uses(node->lhs, loop_depth);
+  scan_uses(node->rhs, loop_depth);
+  scan_uses(node->cond, loop_depth);
+  scan_uses(node->then, loop_depth);
+  scan_uses(node->els, loop_depth);
+  scan_uses(node->init, loop_depth);
+  scan_uses(node->inc, loop_depth);
+  for (Node *n = node->body; n; n = n->next)
+    scan_uses(n, loop_depth);
+  for (Node *n = node->args; n; n = n->next)
+    scan_uses(n, loop_depth);
+}
+
+int cmp_weight(const void *a, const void *b) {
+  long x = (*(Var **)a)->weight;
+  long y = (*(Var **)b)->weight;
+  return (x < y) - (x > y);
+}
+
+// `fn`のローカル変数の使用回数をweightに数え, アドレスを取られる
+// 変数があるかどうかを返す
+bool count_uses(Function *fn) {
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    vl->var->weight = 0;
+    vl->var->addr_taken = false;
+  }
+  addr_taken = false;
+  for (Node *node = fn->node; node; node = node->next)
+    scan_uses(node, 0);
+  return addr_taken;
+}
+
+// `fn`のローカル変数のうち, よく使われるものから順に`regs`のレジスタに
+// 割り当て, 割り当てた数を返す
+int promote_vars(Function *fn, Reg *regs, int nregs) {
+  int nvars = 0;
+  for (VarList *vl = fn->locals; vl; vl = vl->next) {
+    vl->var->is_promoted = false;
+    nvars++;
+  }
+  count_uses(fn);
+
+  Var **vars = calloc(nvars + 1, sizeof(Var *));
+  nvars = 0;
+  for (VarList *vl = fn->locals; vl; vl = vl->next)
+    if (!vl->var->addr_taken && vl->var->ty->kind != TY_ARRAY)
+      vars[nvars++] = vl->var;
+  qsort(vars, nvars, sizeof(Var *), cmp_weight);
+
+  int n = 0;
+  for (int i = 0; i < nvars && n < nregs; i++) {
+    if (vars[i]->weight == 0)
+      break;
+    vars[i]->is_promoted = true;
+    vars[i]->reg = regs[n++];
+  }
+
+  free(vars);
+  return n;
+}
+
+// `fn`がローカル変数のアドレスを取るかどうか
+bool takes_local_addr(Function *fn) { return count_uses(fn); }
@@ -0,0 +1,275 @@
+#include "poacc.h"
+
+#include <limits.h>
+
+// 定数畳み込みと代数的な簡約
+//
+// add_type()の後でASTをその場で書き換える. 畳み込んだ値はNode::valに
+// 収まるときだけNODE_NUMにし, 収まらなければ実行時の計算に任せる.
+
+bool is_num(Node *node, long val) {
+  return node->kind == NODE_NUM && node->val == val;
+}
+
+bool fits_int(long val) { return INT_MIN <= val && val <= INT_MAX; }
+
+// 評価しても副作用がない式かどうか
+bool is_pure(Node *node) {
+  if (!node)
+    return true;
+
+  switch (node->kind) {
+  case NODE_NUM:
+  case NODE_VAR:
+    return true;
+  case NODE_ADD:
+  case NODE_SUB:
+  case NODE_MUL:
+  case NODE_EQ:
+  case NODE_NE:
+  case NODE_LT:
+  case NODE_LE:
+    return is_pure(node->lhs) && is_pure(node->rhs);
+  case NODE_ADDR:
+  case NODE_DEREF:
+    return is_pure(node->lhs);
+  default:
+    // 代入, 関数呼び出し, statement expression, 0除算の可能性がある除算
+    return false;
+  }
+}
+
+// 2つの副作用のない式が同じ値を持つかどうか
+bool same_expr(Node *a, Node *b) {
+  if (!a || !b)
+    return a == b;
+  if (a->kind != b->kind)
+    return false;
+
+  switch (a->kind) {
+  case NODE_NUM:
+    return a->val == b->val;
+  case NODE_VAR:
+    return a->var == b->var;
+  default:
+    return same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+  }
+}
+
+// `node`を`repl`で置き換える. 文や引数のリストをつなぐ`next`は保つ.
+void replace(Node *node, Node *repl) {
+  Node *next = node->next;
+  *node = *repl;
+  node->next = next;
+}
+
+bool set_num(Node *node, long val) {
+  if (!fits_int(val))
+    return false;
+  Node *num = new_num(val, node->tok);
+  num->ty = int_type();
+  replace(node, num);
+  return true;
+}
+
+void set_null(Node *node) { replace(node, new_node(NODE_NULL, node->tok)); }
+
+bool eval_binary(NodeKind kind, long a, long b, long *val) {
+  switch (kind) {
+  case NODE_ADD:
+    *val = a + b;
+    return true;
+  case NODE_SUB:
+    *val = a - b;
+    return true;
+  case NODE_MUL:
+    *val = a * b;
+    return true;
+  case NODE_DIV:
+    // 0除算は実行時に任せる
+    if (b == 0)
+      return false;
+    *val = a / b;
+    return true;
+  case NODE_EQ:
+    *val = a == b;
+    return true;
+  case NODE_NE:
+    *val = a != b;
+    return true;
+  case NODE_LT:
+    *val = a < b;
+    return true;
+  case NODE_LE:
+    *val = a <= b;
+    return true;
+  }
+  return false;
+}
+
+void fold(Node *node);
+
+// (x ± c1) ± c2 => x + (±c1 ± c2)
+//
+// ポインタの加減算はadd_type()で右辺にバイト単位の大きさが掛けてあるので,
+// 同じようにまとめられる.
+bool reassociate(Node *node) {
+  Node *lhs = node->lhs;
+  if (node->rhs->kind != NODE_NUM ||
+      (lhs->kind != NODE_ADD && lhs->kind != NODE_SUB) ||
+      lhs->rhs->kind != NODE_NUM)
+    return false;
+
+  long c1 = (lhs->kind == NODE_ADD) ? lhs->rhs->val : -lhs->rhs->val;
+  long c2 = (node->kind == NODE_ADD) ? node->rhs->val : -node->rhs->val;
+  if (!fits_int(c1 + c2))
+    return false;
+
+  node->kind = NODE_ADD;
+  node->lhs = lhs->lhs;
+  node->rhs = new_num(c1 + c2, node->rhs->tok);
+  node->rhs->ty = int_type();
+  fold(node);
+  return true;
+}
+
+void fold_binary(Node *node) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+
+  long val;
+  if (lhs->kind == NODE_NUM && rhs->kind == NODE_NUM &&
+      eval_binary(node->kind, lhs->val, rhs->val, &val) && set_num(node, val))
+    return;
+
+  switch (node->kind) {
+  case NODE_ADD:
+    // 定数を右辺に寄せる. ポインタは常に左辺にあるので整数同士の加算.
+    if (lhs->kind == NODE_NUM) {
+      node->lhs = rhs;
+      node->rhs = lhs;
+      fold_binary(node);
+      return;
+    }
+    if (is_num(rhs, 0)) {
+      replace(node, lhs);
+      return;
+    }
+    reassociate(node);
+    return;
+  case NODE_SUB:
+    if (is_num(rhs, 0)) {
+      replace(node, lhs);
+      return;
+    }
+    if (is_pure(lhs) && same_expr(lhs, rhs)) {
+      set_num(node, 0);
+      return;
+    }
+    reassociate(node);
+    return;
+  case NODE_MUL:
+    if (lhs->kind == NODE_NUM) {
+      node->lhs = rhs;
+      node->rhs = lhs;
+      fold_binary(node);
+      return;
+    }
+    if (is_num(rhs, 1)) {
+      replace(node, lhs);
+      return;
+    }
+    if (is_num(rhs, 0) && is_pure(lhs))
+      set_num(node, 0);
+    return;
+  case NODE_DIV:
+    if (is_num(rhs, 1))
+      replace(node, lhs);
+    return;
+  case NODE_EQ:
+  case NODE_LE:
+    if (is_pure(lhs) && same_expr(lhs, rhs))
+      set_num(node, 1);
+    return;
+  case NODE_NE:
+  case NODE_LT:
+    if (is_pure(lhs) && same_expr(lhs, rhs))
+      set_num(node, 0);
+    return;
+  }
+}
+
+void fold(Node *node) {
+  if (!node)
+    return;
+
+  fold(node->lhs);
+  fold(node->rhs);
+  fold(node->cond);
+  fold(node->then);
+  fold(node->els);
+  fold(node->init);
+  fold(node->inc);
+  for (Node *n = node->body; n; n = n->next)
+    fold(n);
+  for (Node *n = node->args; n; n = n->next)
+    fold(n);
+
+  switch (node->kind) {
+  case NODE_ADD:
+  case NODE_SUB:
+  case NODE_MUL:
+  case NODE_DIV:
+  case NODE_EQ:
+  case NODE_NE:
+  case NODE_LT:
+  case NODE_LE:
+    fold_binary(node);
+    return;
+  case NODE_EXPR_STMT:
+    if (is_pure(node->lhs))
+      set_null(node);
+    return;
+  case NODE_IF:
+    if (node->cond->kind != NODE_NUM)
+      return;
+    if (node->cond->val)
+      replace(node, node->then);
+    else if (node->els)
+      replace(node, node->els);
+    else
+      set_null(node);
+    return;
+  case NODE_WHILE:
+    if (is_num(node->cond, 0))
+      set_null(node);
+    return;
+  case NODE_FOR:
+    if (!node->cond || node->cond->kind != NODE_NUM)
+      return;
+    if (node->cond->val) {
+      node->cond = NULL;
+    } else if (node->init) {
+      replace(node, node->init);
+    } else {
+      set_null(node);
+    }
+    return;
+  case NODE_STMT_EXPR: {
+    // 最後の式より前が空文だけで, 最後の式が定数ならその値になる
+    Node *last = node->body;
+    for (; last->next; last = last->next)
+      if (last->kind != NODE_NULL)
+        return;
+    if (last->kind == NODE_NUM)
+      set_num(node, last->val);
+    return;
+  }
+  }
+}
+
+void optimize(Program *prog) {
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    for (Node *node = fn->node; node; node = node->next)
+      fold(node);
+}
@@ -1,23 +1,110 @@
 #include "poacc.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 VarList *locals;
 VarList *globals;
-VarList *scope;
+
+// 関数内で宣言したローカル変数の数.
+// 変数のスコープの区間は宣言の位置で表す. k番目に宣言した変数は2k+1から
+// 始まり, スコープを抜けるまでにn個の変数を宣言していれば2n+1で終わる.
+// 偶数の位置2nはn番目の変数を宣言する前の式の中を表す.
+int nlocals;
+
+// 変数のスコープ
+//
+// 名前のハッシュ値で引くハッシュ表. 同じバケットの中では新しく宣言した
+// 変数ほど前にあるので, 最初に見つかったものが内側のスコープの変数になる.
+// 宣言した順にもエントリをつないでおき, `scope`を保存しておいて
+// leave_scope()に渡すとそれ以降に宣言した変数をまとめて取り除ける.
+typedef struct ScopeEntry ScopeEntry;
+struct ScopeEntry {
+  ScopeEntry *next;  // 同じバケットの次のエントリ
+  ScopeEntry *older; // 1つ前に宣言したエントリ
+  Var *var;
+  unsigned hash;
+};
+
+ScopeEntry *scope;
+ScopeEntry **buckets;
+int nbuckets;
+int nentries;
+
+// インターンした名前はアドレスで区別できる
+unsigned hash_name(char *name) {
+  return (unsigned)((uintptr_t)name >> 3) * 2654435761u;
+}
+
+// バケット数を倍にして入れ直す. 新しいものほど前という順序を保つため,
+// 新しい方から順に各バケットの末尾へつなぐ.
+void rehash_scope() {
+  int n = nbuckets ? nbuckets * 2 : 64;
+  ScopeEntry **b = calloc(n, sizeof(ScopeEntry *));
+  ScopeEntry **tail = calloc(n, sizeof(ScopeEntry *));
+
+  for (ScopeEntry *e = scope; e; e = e->older) {
+    int i = e->hash & (n - 1);
+    e->next = NULL;
+    if (tail[i])
+      tail[i]->next = e;
+    else
+      b[i] = e;
+    tail[i] = e;
+  }
+
+  free(buckets);
+  free(tail);
+  buckets = b;
+  nbuckets = n;
+}
+
+void push_scope(Var *var) {
+  if (nentries >= nbuckets)
+    rehash_scope();
+
+  ScopeEntry *e = arena_alloc(&ast_arena, sizeof(ScopeEntry));
+  e->var = var;
+  e->hash = hash_name(var->name);
+
+  int i = e->hash & (nbuckets - 1);
+  e->next = buckets[i];
+  buckets[i] = e;
+  e->older = scope;
+  scope = e;
+  nentries++;
+}
+
+// `sc`より後に宣言した変数をスコープから取り除く
+void leave_scope(ScopeEntry *sc) {
+  while (scope != sc) {
+    ScopeEntry *e = scope;
+    if (e->var->is_local)
+      e->var->scope_end = 2 * nlocals + 1;
+    buckets[e->hash & (nbuckets - 1)] = e->next;
+    scope = e->older;
+    nentries--;
+  }
+}
 
 // Find a variable by name.
 Var *find_var(Token *tok) {
-  for (VarList *vl = scope; vl; vl = vl->next) {
-    Var *var = vl->var;
-    if (strlen(var->name) == tok->len && !memcmp(tok->str, var->name, tok->len))
-      return var;
-  }
+  if (!nbuckets)
+    return NULL;
+
+  unsigned h = hash_name(tok->name);
+  for (ScopeEntry *e = buckets[h & (nbuckets - 1)]; e; e = e->next)
+    if (e->var->name == tok->name)
+      return e->var;
   return NULL;
 }
 
+// 作ったNodeの数. `-ftime-report`で使う
+long nnodes;
+
 Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_alloc(&ast_arena, sizeof(Node));
+  nnodes++;
   node->kind = kind;
   node->tok = tok;
   return node;
@@ -52,17 +139,18 @@ Node *new_var(Var *var, Token *tok) {
   return node;
 }
 
-// ローカル変数のリストに変数を追加
-Var *push_var(char *name, Type *ty, bool is_local) {
-  Var *var = calloc(1, sizeof(Var));
+// ローカル変数かグローバル変数のリストに変数を追加
+Var *add_var(char *name, Type *ty, bool is_local) {
+  Var *var = arena_alloc(&ast_arena, sizeof(Var));
   var->name = name;
   var->ty = ty;
   var->is_local = is_local;
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(&ast_arena, sizeof(VarList));
   vl->var = var;
 
   if (is_local) {
+    var->scope_begin = 2 * nlocals++ + 1;
     vl->next = locals;
     locals = vl;
   } else {
@@ -70,11 +158,13 @@ Var *push_var(char *name, Type *ty, bool is_local) {
     globals = vl;
   }
 
-  VarList *sc = calloc(1, sizeof(VarList));
-  sc->var = var;
-  sc->next = scope;
-  scope = sc;
+  return var;
+}
 
+// 変数を追加し, 現在のスコープで名前から引けるようにする
+Var *push_var(char *name, Type *ty, bool is_local) {
+  Var *var = add_var(name, ty, is_local);
+  push_scope(var);
   return var;
 }
 
@@ -85,6 +175,63 @@ char *new_label() {
   return strndupl(buf, 20);
 }
 
+// 文字列リテラルのプール
+//
+// 中身が同じ文字列リテラルは1つのグローバル変数を共有する. 中身は
+// インターンされているので, ポインタが同じなら中身も同じ.
+typedef struct StrLit StrLit;
+struct StrLit {
+  StrLit *next;
+  Var *var;
+};
+
+StrLit **strlits;
+int nstrlit_buckets;
+int nstrlits;
+
+void rehash_strlits() {
+  int n = nstrlit_buckets ? nstrlit_buckets * 2 : 64;
+  StrLit **b = calloc(n, sizeof(StrLit *));
+
+  for (int i = 0; i < nstrlit_buckets; i++) {
+    StrLit *sl = strlits[i];
+    while (sl) {
+      StrLit *next = sl->next;
+      int j = hash_name(sl->var->contents) & (n - 1);
+      sl->next = b[j];
+      b[j] = sl;
+      sl = next;
+    }
+  }
+
+  free(strlits);
+  strlits = b;
+  nstrlit_buckets = n;
+}
+
+Var *string_literal(Token *tok) {
+  if (nstrlits >= nstrlit_buckets)
+    rehash_strlits();
+
+  StrLit **bucket = &strlits[hash_name(tok->contents) & (nstrlit_buckets - 1)];
+  for (StrLit *sl = *bucket; sl; sl = sl->next)
+    if (sl->var->contents == tok->contents)
+      return sl->var;
+
+  Type *ty = array_of(char_type(), tok->cont_len);
+  // 名前で参照されることはないのでスコープには入れない
+  Var *var = add_var(new_label(), ty, false);
+  var->contents = tok->contents;
+  var->cont_len = tok->cont_len;
+
+  StrLit *sl = arena_alloc(&ast_arena, sizeof(StrLit));
+  sl->var = var;
+  sl->next = *bucket;
+  *bucket = sl;
+  nstrlits++;
+  return var;
+}
+
 Function *function();
 Type *basetype();
 void global_var();
@@ -124,17 +271,19 @@ Program *program() {
     }
   }
 
-  Program *prog = calloc(1, sizeof(Program));
+  Program *prog = arena_alloc(&ast_arena, sizeof(Program));
   prog->globals = globals;
   prog->fns = head.next;
   return prog;
 }
 
-// basetype = ("char" | "int") "*"*
+// basetype = ("char" | "int" | "long") "*"*
 Type *basetype() {
   Type *ty;
   if (consume("char")) {
     ty = char_type();
+  } else if (consume("long")) {
+    ty = long_type();
   } else {
     expect("int");
     ty = int_type();
@@ -159,7 +308,7 @@ VarList *read_func_param() {
   char *name = expect_ident();
   ty = read_type_suffix(ty);
 
-  VarList *vl = calloc(1, sizeof(VarList));
+  VarList *vl = arena_alloc(&ast_arena, sizeof(VarList));
   vl->var = push_var(name, ty, true);
   return vl;
 }
@@ -185,9 +334,11 @@ VarList *read_func_params() {
 // `param    = basetype ident`
 Function *function() {
   locals = NULL;
+  nlocals = 0;
+  ScopeEntry *sc = scope;
 
-  Function *fn = calloc(1, sizeof(Function));
-  basetype();
+  Function *fn = arena_alloc(&ast_arena, sizeof(Function));
+  fn->ty = basetype();
   fn->name = expect_ident();
   expect("(");
   fn->params = read_func_params();
@@ -203,6 +354,7 @@ Function *function() {
 
   fn->node = head.next;
   fn->locals = locals;
+  leave_scope(sc);
   return fn;
 }
 
@@ -240,7 +392,7 @@ Node *read_expr_stmt() {
   return new_unary(NODE_EXPR_STMT, expr(), tok);
 }
 
-bool is_typename() { return peek("char") || peek("int"); }
+bool is_typename() { return peek("char") || peek("int") || peek("long"); }
 
 // `stmt = "return" expr ";"
 //        | "{" stmt* "}"
@@ -301,12 +453,12 @@ Node *stmt() {
     head.next = NULL;
     Node *cur = &head;
 
-    VarList *sc = scope;
+    ScopeEntry *sc = scope;
     while (!consume("}")) {
       cur->next = stmt();
       cur = cur->next;
     }
-    scope = sc;
+    leave_scope(sc);
 
     Node *node = new_node(NODE_BLOCK, tok);
     node->body = head.next;
@@ -430,7 +582,7 @@ Node *postfix() {
 //
 // statement expression is a GNU C extension.
 Node *stmt_expr(Token *tok) {
-  VarList *sc = scope;
+  ScopeEntry *sc = scope;
 
   Node *node = new_node(NODE_STMT_EXPR, tok);
   node->body = stmt();
@@ -442,7 +594,7 @@ Node *stmt_expr(Token *tok) {
   }
   expect(")");
 
-  scope = sc;
+  leave_scope(sc);
 
   if (cur->kind != NODE_EXPR_STMT)
     error_tok(cur->tok, "stmt expr returning void is not supported");
@@ -490,8 +642,10 @@ Node *primary() {
   if (tok = consume_ident()) {
     if (consume("(")) {
       Node *node = new_node(NODE_FUNCALL, tok);
-      node->funcname = strndupl(tok->str, tok->len);
+      node->funcname = tok->name;
+      node->scope_begin = 2 * nlocals;
       node->args = func_args();
+      node->scope_end = 2 * nlocals + 1;
       return node;
     }
     Var *var = find_var(tok);
@@ -504,11 +658,7 @@ Node *primary() {
   if (tok->kind == TK_STR) {
     token = token->next;
 
-    Type *ty = array_of(char_type(), tok->cont_len);
-    Var *var = push_var(new_label(), ty, false);
-    var->contents = tok->contents;
-    var->cont_len = tok->cont_len;
-    return new_var(var, tok);
+    return new_var(string_literal(tok), tok);
   }
 
   if (tok->kind != TK_NUM)
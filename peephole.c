@@ -0,0 +1,220 @@
+#include "poacc.h"
+
+// 命令列に対するpeephole最適化
+//
+// 各ルールは`insn`から始まる命令列を見て, 書き換えた場合は削除した命令数を
+// 返す. ルールが削除してよいのは`insn`自身とそれより後の命令だけ.
+// どのルールも適用できなくなるまで命令列全体を繰り返し走査する.
+
+bool is_reg(Operand op, Reg r) {
+  return op.kind == OPND_REG && op.size == 8 && op.reg == r;
+}
+
+bool is_imm(Operand op, long val) {
+  return op.kind == OPND_IMM && op.val == val;
+}
+
+// `push X; pop R` => `mov R, X` (X == Rなら両方消す)
+int push_pop(Insn *insn) {
+  Insn *next = insn->next;
+  if (insn->kind != INSN_PUSH || !next || next->kind != INSN_POP)
+    return 0;
+
+  if (same_op(insn->dst, next->dst)) {
+    delete_insn(insn);
+    delete_insn(next);
+    return 2;
+  }
+
+  next->kind = INSN_MOV;
+  next->src = insn->dst;
+  delete_insn(insn);
+  return 1;
+}
+
+// `push X; add rsp, 8` => (none)
+int push_discard(Insn *insn) {
+  Insn *next = insn->next;
+  if (insn->kind != INSN_PUSH || !next || next->kind != INSN_ADD ||
+      !is_reg(next->dst, RSP) || !is_imm(next->src, 8))
+    return 0;
+
+  delete_insn(insn);
+  delete_insn(next);
+  return 2;
+}
+
+// `mov R, R` => (none)
+int mov_self(Insn *insn) {
+  if (insn->kind != INSN_MOV || insn->dst.kind != OPND_REG ||
+      insn->dst.size != 8 || !same_op(insn->dst, insn->src))
+    return 0;
+
+  delete_insn(insn);
+  return 1;
+}
+
+// `mov A, B; mov B, A` => `mov A, B`
+int mov_back(Insn *insn) {
+  Insn *next = insn->next;
+  if (insn->kind != INSN_MOV || !next || next->kind != INSN_MOV ||
+      insn->dst.kind != OPND_REG || insn->src.kind != OPND_REG ||
+      !same_op(insn->dst, next->src) || !same_op(insn->src, next->dst))
+    return 0;
+
+  delete_insn(next);
+  return 1;
+}
+
+bool reads_reg(Operand op, Reg r) {
+  if (op.kind == OPND_MEM && op.scale && op.index == r)
+    return true;
+  return (op.kind == OPND_REG || op.kind == OPND_MEM) && op.reg == r;
+}
+
+// `mov R, X; mov R, Y` => `mov R, Y` (YがRを読まない場合)
+int mov_overwritten(Insn *insn) {
+  Insn *next = insn->next;
+  if (insn->kind != INSN_MOV || insn->dst.kind != OPND_REG ||
+      insn->dst.size != 8 || !next)
+    return 0;
+
+  switch (next->kind) {
+  case INSN_MOV:
+  case INSN_MOVSX:
+  case INSN_MOVZX:
+  case INSN_LEA:
+    break;
+  default:
+    return 0;
+  }
+
+  if (!is_reg(next->dst, insn->dst.reg) ||
+      reads_reg(next->src, insn->dst.reg))
+    return 0;
+
+  delete_insn(insn);
+  return 1;
+}
+
+// `cmp A, B; setCC R; movzx R, R; cmp R, 0; je L` => `cmp A, B; jNCC L`
+//
+// 条件分岐で比較する値は分岐の後で使われない一時値なので,
+// Rに0/1を作る必要はない.
+int setcc_branch(Insn *insn) {
+  Insn *set = insn->next;
+  if (insn->kind != INSN_CMP || !set || set->kind != INSN_SETCC)
+    return 0;
+
+  Insn *movzx = set->next;
+  if (!movzx || movzx->kind != INSN_MOVZX || movzx->src.reg != set->dst.reg)
+    return 0;
+
+  Insn *cmp = movzx->next;
+  if (!cmp || cmp->kind != INSN_CMP || !same_op(cmp->dst, movzx->dst) ||
+      !is_imm(cmp->src, 0))
+    return 0;
+
+  Insn *jcc = cmp->next;
+  if (!jcc || jcc->kind != INSN_JCC || (jcc->cc != CC_E && jcc->cc != CC_NE))
+    return 0;
+
+  jcc->cc = (jcc->cc == CC_E) ? negate_cc(set->cc) : set->cc;
+  delete_insn(set);
+  delete_insn(movzx);
+  delete_insn(cmp);
+  return 3;
+}
+
+// `jmp L; L:` => `L:`
+int jmp_next(Insn *insn) {
+  if (insn->kind != INSN_JMP)
+    return 0;
+
+  for (Insn *next = insn->next; next && next->kind == INSN_LABEL;
+       next = next->next) {
+    if (!strcmp(next->label, insn->label)) {
+      delete_insn(insn);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// jmpやretの後からラベルまでの命令は実行されない
+int unreachable(Insn *insn) {
+  if (insn->kind != INSN_JMP && insn->kind != INSN_RET)
+    return 0;
+
+  int n = 0;
+  while (insn->next && insn->next->kind != INSN_LABEL) {
+    delete_insn(insn->next);
+    n++;
+  }
+  return n;
+}
+
+typedef struct {
+  char *name;
+  int (*fn)(Insn *insn);
+  bool disabled;
+  int removed; // 削除した命令数
+} PeepholeRule;
+
+PeepholeRule rules[] = {
+    {"push-pop", push_pop},
+    {"push-discard", push_discard},
+    {"mov-self", mov_self},
+    {"mov-back", mov_back},
+    {"mov-overwritten", mov_overwritten},
+    {"setcc-branch", setcc_branch},
+    {"jmp-next", jmp_next},
+    {"unreachable", unreachable},
+};
+
+int nrules = sizeof(rules) / sizeof(*rules);
+
+bool disable_peephole_rule(char *name) {
+  for (int i = 0; i < nrules; i++) {
+    if (!strcmp(rules[i].name, name)) {
+      rules[i].disabled = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+void peephole(Insn *insns) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (Insn *insn = insns->next; insn; insn = insn->next) {
+      for (int i = 0; i < nrules; i++) {
+        if (rules[i].disabled)
+          continue;
+        int n = rules[i].fn(insn);
+        if (n == 0)
+          continue;
+
+        // `insn`自身が消えているかもしれないので, 1つ前からやり直す
+        rules[i].removed += n;
+        changed = true;
+        insn = insn->prev;
+        break;
+      }
+    }
+  }
+}
+
+void print_peephole_stats() {
+  int total = 0;
+  fprintf(stderr, "%-16s %8s\n", "peephole rule", "removed");
+  for (int i = 0; i < nrules; i++) {
+    if (rules[i].disabled)
+      fprintf(stderr, "%-16s %8s\n", rules[i].name, "-");
+    else
+      fprintf(stderr, "%-16s %8d\n", rules[i].name, rules[i].removed);
+    total += rules[i].removed;
+  }
+  fprintf(stderr, "%-16s %8d\n", "total", total);
+}
@@ -6,10 +6,40 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdnoreturn.h>
 #include <string.h>
 
 typedef struct Type Type;
 
+/*
+******** ARENA ********
+*/
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+  char *name;
+  ArenaBlock *blocks;
+  char *ptr; // 今のブロックの空き領域の先頭
+  char *end; // 今のブロックの末尾
+  bool freed;
+
+  // 統計
+  long bytes;
+  long objects;
+} Arena;
+
+extern Arena token_arena; // Token
+extern Arena ast_arena;   // Node, Var, VarList, Function, Program
+extern Arena type_arena;  // Type
+extern Arena string_arena; // インターンした文字列
+
+void *arena_alloc(Arena *arena, int size);
+void arena_free(Arena *arena);
+void print_arena_stats();
+
+char *intern(char *s, int len);
+
 /*
 ******** TOKEN ********
 */
@@ -31,14 +61,16 @@ struct Token {
   int val;        // TK_NUM時の値
   char *str;      // tokenの文字列
   int len;        // tokenの長さ
+  char *name;     // TK_IDENT時のインターンした名前
 
   char *contents; // string literal contents including termination '\0'
-  char cont_len;  // string literal length
+  int cont_len;   // string literal length
 };
 
-void error(char *fmt, ...);
-void error_at(char *loc, char *fmt, ...);
-void error_tok(Token *tok, char *fmt, ...);
+noreturn void error(char *fmt, ...);
+char *format(char *fmt, ...);
+noreturn void error_at(char *loc, char *fmt, ...);
+noreturn void error_tok(Token *tok, char *fmt, ...);
 Token *peek(char *s);
 Token *consume(char *op);
 char *strndupl(char *p, int len);
@@ -68,10 +100,23 @@ struct Var {
 
   // local variable
   int offset; // Offset from RBP
+  // 宣言してからスコープを抜けるまでの区間. 区間が重ならない変数は
+  // 同じ領域に置ける
+  int scope_begin;
+  int scope_end;
+  long weight;      // 使用回数. ループの中の使用ほど重い
+  bool is_promoted; // mem2reg: メモリではなくレジスタregに置く
+  bool addr_taken;  // mem2reg: アドレスを取られる
+  int reg;          // Reg
 
   // global variable
   char *contents;
   int cont_len;
+
+  // 文字列リテラルの中身が別の文字列リテラルの末尾と同じなら,
+  // その変数と先頭からのオフセット
+  Var *suffix_of;
+  int suffix_offset;
 };
 
 typedef struct VarList VarList;
@@ -131,19 +176,29 @@ struct Node {
   // Function call
   char *funcname;
   Node *args;
+  // 引数を含む呼び出し全体のスコープの区間. インライン展開した変数に使う
+  int scope_begin;
+  int scope_end;
 
   Var *var; // Used if kind == NODE_VAR
   int val;  // Used if kind == NODE_NUM
 };
 
+typedef struct BasicBlock BasicBlock;
+
 typedef struct Function Function;
 struct Function {
   Function *next;
   char *name;
+  Type *ty; // 戻り値の型
   VarList *params;
   Node *node;
   VarList *locals;
   int stack_size;
+
+  // IR. lower_ir()で作る
+  BasicBlock *bbs;
+  int nvregs;
 };
 
 typedef struct {
@@ -151,19 +206,308 @@ typedef struct {
   Function *fns;
 } Program;
 
+extern long nnodes;
+
+Node *new_node(NodeKind kind, Token *tok);
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok);
+Node *new_num(int val, Token *tok);
 Program *program();
 
+/*
+******** OPTIMIZER ********
+*/
+
+extern int opt_inline_limit;
+
+void inline_functions(Program *prog);
+void optimize(Program *prog);
+
+/*
+******** IR ********
+*/
+
+// 基本ブロックと仮想レジスタからなる3番地コード.
+// 仮想レジスタは1から番号を振り, それぞれちょうど1回だけ定義する.
+// ローカル変数はメモリに置いたままで, load/storeで読み書きする.
+typedef enum {
+  IR_IMM,   // d = imm
+  IR_LVAR,  // d = &var (local)
+  IR_GVAR,  // d = &var (global)
+  IR_LOAD,  // d = *a
+  IR_STORE, // *a = b
+  IR_ADD,   // d = a + b
+  IR_SUB,   // d = a - b
+  IR_MUL,   // d = a * b
+  IR_DIV,   // d = a / b
+  IR_EQ,    // d = a == b
+  IR_NE,    // d = a != b
+  IR_LT,    // d = a < b
+  IR_LE,    // d = a <= b
+  IR_CALL,  // d = funcname(args...)
+  IR_JMP,   // goto then
+  IR_BR,    // if (a) goto then; else goto els
+  IR_RET,   // return a
+} IRKind;
+
+typedef struct IR IR;
+struct IR {
+  IRKind kind;
+  IR *next;
+
+  int d; // 結果の仮想レジスタ
+  int a;
+  int b;
+  bool is_imm; // bの代わりに即値immを使う
+  long imm;    // IR_IMM | 即値のb
+  int size;    // IR_LOAD | IR_STORE | IR_CALL
+  Var *var;    // IR_LVAR | IR_GVAR
+
+  // IR_CALL
+  char *funcname;
+  int *args;
+  int nargs;
+
+  // IR_JMP | IR_BR
+  BasicBlock *then;
+  BasicBlock *els;
+};
+
+struct BasicBlock {
+  BasicBlock *next;
+  int id;
+  char *label;
+  IR *ir;
+  IR *last;
+};
+
+extern bool opt_ir;
+extern bool opt_dump_ir;
+
+void lower_ir(Program *prog);
+void verify_ir(Program *prog);
+void dump_ir(Program *prog);
+int ir_uses(IR *ir, int *uses);
+void gen_ir_text(Program *prog);
+
+/*
+******** ASSEMBLY ********
+*/
+
+typedef enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+} Reg;
+
+// Condition code of setcc and jcc
+typedef enum { CC_E, CC_NE, CC_L, CC_LE, CC_G, CC_GE } CondCode;
+
+typedef enum {
+  OPND_NONE, // No operand
+  OPND_REG,  // Register
+  OPND_IMM,  // Immediate
+  OPND_MEM,  // [base+index*scale+disp]
+  OPND_SYM,  // [rip+sym+disp]
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  int size; // Operand size in bytes
+  Reg reg;  // Register or base register of a memory operand
+  Reg index; // Index register of a memory operand
+  int scale; // 1, 2, 4 or 8. 0ならindexを使わない
+  int disp; // Displacement of a memory operand
+  long val; // Immediate value
+  char *sym;
+} Operand;
+
+typedef enum {
+  INSN_LABEL, // label:
+  INSN_MOV,
+  INSN_MOVSX,
+  INSN_MOVZX,
+  INSN_LEA,
+  INSN_PUSH,
+  INSN_POP,
+  INSN_ADD,
+  INSN_SUB,
+  INSN_IMUL, // 2オペランド, または1オペランドでrdx:rax = rax * dst
+  INSN_CQO,
+  INSN_IDIV,
+  INSN_NEG,
+  INSN_SHL,
+  INSN_SAR,
+  INSN_SHR,
+  INSN_AND,
+  INSN_CMP,
+  INSN_SETCC,
+  INSN_JMP,
+  INSN_JCC,
+  INSN_CALL,
+  INSN_RET,
+} InsnKind;
+
+// x86-64 instruction
+typedef struct Insn Insn;
+struct Insn {
+  InsnKind kind;
+  Insn *next;
+  Insn *prev;
+
+  Operand dst;
+  Operand src;
+
+  CondCode cc; // setcc | jcc
+  char *label; // label | jmp | jcc | call
+};
+
+Operand reg_op(Reg r);
+Operand reg8_op(Reg r);
+Operand sized_reg_op(Reg r, int size);
+Operand imm_op(long val);
+Operand mem_op(Reg base, int disp, int size);
+Operand index_op(Reg base, Reg index, int scale, int disp, int size);
+Operand sym_op(char *name);
+bool same_op(Operand a, Operand b);
+
+Insn *emit0(InsnKind kind);
+Insn *emit1(InsnKind kind, Operand dst);
+Insn *emit2(InsnKind kind, Operand dst, Operand src);
+Insn *emit_label(char *label);
+Insn *emit_jmp(char *label);
+Insn *emit_jcc(CondCode cc, char *label);
+Insn *emit_setcc(CondCode cc, Reg r);
+Insn *emit_call(char *name);
+void delete_insn(Insn *insn);
+CondCode negate_cc(CondCode cc);
+void print_insns(Insn *insn);
+
+// emit*()で作った命令はcursorの直後に挿入される
+extern Insn *insns;
+extern Insn *cursor;
+
+/*
+******** PEEPHOLE ********
+*/
+
+extern bool opt_peephole;
+extern bool opt_stats;
+
+bool disable_peephole_rule(char *name);
+void peephole(Insn *insns);
+void print_peephole_stats();
+
+/*
+******** OBJECT ********
+*/
+
+// セクション. 番号はそのままELFのセクション番号になる
+typedef enum {
+  SEC_UNDEF,
+  SEC_TEXT,
+  SEC_DATA,
+  SEC_BSS,
+  SEC_RODATA,
+  NSECTIONS,
+} SectionId;
+
+typedef struct {
+  char *name;
+  char *data; // .bssならNULL
+  long size;
+  long cap;
+  int align;
+} Section;
+
+typedef struct ObjSym ObjSym;
+struct ObjSym {
+  ObjSym *next;  // ハッシュ表の同じバケットの次のシンボル
+  ObjSym *older; // 1つ前に作ったシンボル
+  char *name;    // インターンした名前
+  SectionId sec; // SEC_UNDEFなら未定義
+  long offset;
+  bool is_global;
+  bool is_func;
+  int index;  // ELFのシンボルテーブルでの番号
+  void *addr; // --runで解決した外部のシンボルのアドレス
+};
+
+typedef enum {
+  RELOC_PC32,  // 32ビットのPC相対アドレス
+  RELOC_PLT32, // 関数呼び出し
+} RelocType;
+
+// .textの中の書き換えが必要な箇所
+typedef struct Reloc Reloc;
+struct Reloc {
+  Reloc *next;
+  long offset;
+  ObjSym *sym;
+  RelocType type;
+  long addend;
+};
+
+extern Section sections[NSECTIONS];
+extern ObjSym *objsyms; // 作った順の逆
+extern int nsyms;
+extern Reloc *relocs;
+
+ObjSym *get_sym(char *name);
+void assemble(Program *prog, Insn *insns);
+void emit_elf();
+void *jit_link();
+
+/*
+******** TIME REPORT ********
+*/
+
+extern bool opt_time_report;
+extern bool opt_time_report_json;
+
+void phase_begin();
+void phase_end(char *name);
+void print_time_report();
+
+/*
+******** EMITTER ********
+*/
+
+void out_mem(char *s, int len);
+void out_str(char *s);
+void out_char(char c);
+void out_int(long val);
+long output_len();
+void write_output(char *path);
+
 /*
 ******** CODE GENERATOR ********
 */
 
+extern bool opt_regalloc;
+extern bool opt_mem2reg;
+extern bool opt_omit_frame_pointer;
+extern bool opt_tail_call;
+extern bool opt_emit_obj;
+extern bool opt_run;
+
+extern Reg argreg[];
+
+int align_to(int n, int align);
+bool is_callee_saved(Reg r);
+void load_arg(Var *var, int idx);
+void merge_string_suffixes(Program *prog);
+bool count_uses(Function *fn);
+int cmp_weight(const void *a, const void *b);
+int promote_vars(Function *fn, Reg *regs, int nregs);
+bool takes_local_addr(Function *fn);
+void layout_frame(Function *fn);
+
 void codegen(Program *prog);
 
 /*
 ******** TYPE ********
 */
 
-typedef enum { TY_CHAR, TY_INT, TY_PTR, TY_ARRAY } TypeKind;
+typedef enum { TY_CHAR, TY_INT, TY_LONG, TY_PTR, TY_ARRAY } TypeKind;
 
 struct Type {
   TypeKind kind;
@@ -173,9 +517,11 @@ struct Type {
 
 Type *char_type();
 Type *int_type();
+Type *long_type();
 Type *pointer_to(Type *base);
 Type *array_of(Type *base, int size);
 int size_of(Type *ty);
+int align_of(Type *ty);
 
 void add_type(Program *prog);
 
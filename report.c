@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "poacc.h"
+
+#include <sys/resource.h>
+#include <time.h>
+
+// `-ftime-report`: コンパイルのフェーズごとの時間とメモリの報告
+//
+// 個数は各フェーズの間に確保したオブジェクトの数 (astはNodeの数),
+// RSSはそのフェーズを終えた時点での最大値, バイト数は出力バッファに
+// 追記した大きさ.
+
+typedef struct {
+  char *name;
+  double time; // 秒
+  long tokens;
+  long ast;
+  long types;
+  long rss;   // KiB
+  long bytes;
+} Phase;
+
+Phase phases[16];
+int nphases;
+
+// 今のフェーズの開始時の値
+double start_time;
+long start_tokens;
+long start_ast;
+long start_types;
+long start_bytes;
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void phase_begin() {
+  if (!opt_time_report)
+    return;
+  start_time = now();
+  start_tokens = token_arena.objects;
+  start_ast = nnodes;
+  start_types = type_arena.objects;
+  start_bytes = output_len();
+}
+
+void phase_end(char *name) {
+  if (!opt_time_report)
+    return;
+  assert(nphases < sizeof(phases) / sizeof(*phases));
+
+  Phase *ph = &phases[nphases++];
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  ph->name = name;
+  ph->time = now() - start_time;
+  ph->tokens = token_arena.objects - start_tokens;
+  ph->ast = nnodes - start_ast;
+  ph->types = type_arena.objects - start_types;
+  ph->rss = ru.ru_maxrss;
+  ph->bytes = output_len() - start_bytes;
+}
+
+// JSONの文字列として出力する
+void print_json_string(char *s) {
+  fputc('"', stderr);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(stderr, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(stderr, "\\u%04x", *s);
+    else
+      fputc(*s, stderr);
+  }
+  fputc('"', stderr);
+}
+
+void print_time_report_json() {
+  fprintf(stderr, "{\"file\": ");
+  print_json_string(filename);
+  fprintf(stderr, ", \"phases\": [");
+  for (int i = 0; i < nphases; i++) {
+    Phase *ph = &phases[i];
+    fprintf(stderr,
+            "%s\n  {\"name\": \"%s\", \"time\": %.6f, \"tokens\": %ld, "
+            "\"ast\": %ld, \"types\": %ld, \"rss_kib\": %ld, \"bytes\": %ld}",
+            i ? "," : "", ph->name, ph->time, ph->tokens, ph->ast, ph->types,
+            ph->rss, ph->bytes);
+  }
+  fprintf(stderr, "\n]}\n");
+}
+
+void print_time_report() {
+  if (opt_time_report_json) {
+    print_time_report_json();
+    return;
+  }
+
+  Phase total = {"total"};
+  fprintf(stderr, "%-10s %10s %9s %9s %9s %10s %10s\n", "phase", "time(ms)",
+          "tokens", "ast", "types", "rss(KiB)", "bytes");
+  for (int i = 0; i <= nphases; i++) {
+    Phase *ph = (i < nphases) ? &phases[i] : &total;
+    fprintf(stderr, "%-10s %10.3f %9ld %9ld %9ld %10ld %10ld\n", ph->name,
+            ph->time * 1000, ph->tokens, ph->ast, ph->types, ph->rss,
+            ph->bytes);
+
+    if (i < nphases) {
+      total.time += ph->time;
+      total.tokens += ph->tokens;
+      total.ast += ph->ast;
+      total.types += ph->types;
+      if (total.rss < ph->rss)
+        total.rss = ph->rss;
+      total.bytes += ph->bytes;
+    }
+  }
+}
@@ -8,13 +8,17 @@ int sub(int x, int y) { return x-y; }
 int add6(int a, int b, int c, int d, int e, int f) {
   return a+b+c+d+e+f;
 }
+int neg1() { return -1; }
+// 呼び出し時にRSPが16バイト境界に揃っていれば1
+int aligned() { return ((long)__builtin_frame_address(0) & 15) == 0; }
 EOF
 
 assert() {
   expected="$1"
   input="$2"
 
-  ./poacc <(echo "$input") > tmp.s
+  # 3番目以降の引数はコンパイラへのオプション
+  ./poacc "${@:3}" -o tmp.s <(echo "$input")
   gcc -static -o tmp tmp.s tmp2.o
   ./tmp
   actual="$?"
@@ -90,6 +94,7 @@ assert 2 'int main() { if (2-1) return 2; return 3; }'
 
 # step12-2 while
 assert 3 'int main() { {1; {2;} return 3;} }'
+assert 5 'int main() { int a=5; { int b=1; } { int c=2; } return a; }'
 
 # step12-3 for
 assert 10 'int main() { int i=0; i=0; while(i<10) i=i+1; return i; }'
@@ -108,6 +113,29 @@ assert 8 'int main() { return add(3, 5); }'
 assert 2 'int main() { return sub(5, 3); }'
 assert 21 'int main() { return add6(1,2,3,4,5,6); }'
 
+# レジスタ割り当て (spill)
+assert 55 'int main() { return 1+(2+(3+(4+(5+(6+(7+(8+(9+10)))))))); }'
+assert 55 'int main() { return 1+(2+(3+(4+(5+(6+(7+(8+add(9,10)))))))); }'
+assert 20 'int main() { return 1+(2+(3+(4+(5+add6(1,add(1,0),3-1+1,4,5,6)))))-15; }'
+
+# 定数畳み込み
+assert 3 'int main() { int x=3; return x*0 + x-x + (x+0)*1 - 0; }'
+assert 7 'int main() { int x[4]; x[3]=7; return *(x+1+2); }'
+assert 7 'int main() { int x[4]; x[1]=7; return *(x+3-2); }'
+assert 12 'int main() { int x[4]; return sizeof(x)/sizeof(x[0])*(2+1); }'
+assert 5 'int main() { int x=0; return (x=5)*0 + x; }'
+assert 2 'int main() { if (0) return 1; while (0) return 3; for (;0;) return 4; return 2; }'
+assert 255 'int main() { return -1; }'
+
+# 比較と分岐
+assert 10 'int main() { int i=0; while (i<10) i=i+1; return i; }'
+assert 11 'int main() { int i=0; while (i<=10) i=i+1; return i; }'
+assert 3 'int main() { int i=0; while (i!=3) i=i+1; return i; }'
+assert 5 'int main() { int i=0; int j=5; while (i==0) i=j; return i; }'
+assert 7 'int main() { int i; for (i=0; 3>i; i=i+1) 0; for (; i>=2; i=i-1) 0; return i+6; }'
+assert 2 'int main() { int x=2; if (x) return x; return 9; }'
+assert 4 'int main() { int x=5; if (x<x+1) return 4; else return 9; }'
+
 # step15-1 関数の定義(引数なし)
 assert 32 'int main() { return ret32(); } int ret32() { return 32; }'
 
@@ -119,16 +147,17 @@ assert 55 'int main() { return fib(9); } int fib(int x) { if (x<=1) return 1; re
 # step16 &と*
 # step17 int
 # step18, 19 pointer型
+# 隣の変数へ届くポインタ演算は, 変数がすべてメモリにあるときだけ成り立つ
 assert 3 'int main() { int x=3; return *&x; }'
 assert 3 'int main() { int x=3; int *y=&x; int **z=&y; return **z; }'
-assert 5 'int main() { int x=3; int y=5; return *(&x+1); }'
-assert 5 'int main() { int x=3; int y=5; return *(1+&x); }'
-assert 3 'int main() { int x=3; int y=5; return *(&y-1); }'
-assert 5 'int main() { int x=3; int y=5; int *z=&x; return *(z+1); }'
-assert 3 'int main() { int x=3; int y=5; int *z=&y; return *(z-1); }'
+assert 5 'int main() { int x=3; int y=5; return *(&x+1); }' -fno-mem2reg
+assert 5 'int main() { int x=3; int y=5; return *(1+&x); }' -fno-mem2reg
+assert 3 'int main() { int x=3; int y=5; return *(&y-1); }' -fno-mem2reg
+assert 5 'int main() { int x=3; int y=5; int *z=&x; return *(z+1); }' -fno-mem2reg
+assert 3 'int main() { int x=3; int y=5; int *z=&y; return *(z-1); }' -fno-mem2reg
 assert 5 'int main() { int x=3; int *y=&x; *y=5; return x; }'
-assert 7 'int main() { int x=3; int y=5; *(&x+1)=7; return y; }'
-assert 7 'int main() { int x=3; int y=5; *(&y-1)=7; return x; }'
+assert 7 'int main() { int x=3; int y=5; *(&x+1)=7; return y; }' -fno-mem2reg
+assert 7 'int main() { int x=3; int y=5; *(&y-1)=7; return x; }' -fno-mem2reg
 assert 8 'int main() { int x=3; int y=5; return foo(&x, y); } int foo(int *x, int y) { return *x + y; }'
 
 # step21 多次元配列
@@ -160,16 +189,16 @@ assert 5 'int main() { int x[2][3]; int *y=x; y[5]=5; return x[1][2]; }'
 assert 6 'int main() { int x[2][3]; int *y=x; y[6]=6; return x[2][0]; }'
 
 # step20 sizeof
-assert 8 'int main() { int x; return sizeof(x); }'
-assert 8 'int main() { int x; return sizeof x; }'
+assert 4 'int main() { int x; return sizeof(x); }'
+assert 4 'int main() { int x; return sizeof x; }'
 assert 8 'int main() { int *x; return sizeof(x); }'
-assert 32 'int main() { int x[4]; return sizeof(x); }'
-assert 96 'int main() { int x[3][4]; return sizeof(x); }'
-assert 32 'int main() { int x[3][4]; return sizeof(*x); }'
-assert 8 'int main() { int x[3][4]; return sizeof(**x); }'
-assert 9 'int main() { int x[3][4]; return sizeof(**x) + 1; }'
-assert 9 'int main() { int x[3][4]; return sizeof **x + 1; }'
-assert 8 'int main() { int x[3][4]; return sizeof(**x + 1); }'
+assert 16 'int main() { int x[4]; return sizeof(x); }'
+assert 48 'int main() { int x[3][4]; return sizeof(x); }'
+assert 16 'int main() { int x[3][4]; return sizeof(*x); }'
+assert 4 'int main() { int x[3][4]; return sizeof(**x); }'
+assert 5 'int main() { int x[3][4]; return sizeof(**x) + 1; }'
+assert 5 'int main() { int x[3][4]; return sizeof **x + 1; }'
+assert 4 'int main() { int x[3][4]; return sizeof(**x + 1); }'
 
 # step23 グローバル変数
 assert 0 'int x; int main() { return x; }'
@@ -178,8 +207,8 @@ assert 0 'int x[4]; int main() { x[0]=0; x[1]=1; x[2]=2; x[3]=3; return x[0]; }'
 assert 1 'int x[4]; int main() { x[0]=0; x[1]=1; x[2]=2; x[3]=3; return x[1]; }'
 assert 2 'int x[4]; int main() { x[0]=0; x[1]=1; x[2]=2; x[3]=3; return x[2]; }'
 assert 3 'int x[4]; int main() { x[0]=0; x[1]=1; x[2]=2; x[3]=3; return x[3]; }'
-assert 8 'int x; int main() { return sizeof(x); }'
-assert 32 'int x[4]; int main() { return sizeof(x); }'
+assert 4 'int x; int main() { return sizeof(x); }'
+assert 16 'int x[4]; int main() { return sizeof(x); }'
 
 # step24 文字型
 assert 1 'int main() { char x=1; return x; }'
@@ -187,6 +216,7 @@ assert 1 'int main() { char x=1; char y=2; return x; }'
 assert 2 'int main() { char x=1; char y=2; return y; }'
 assert 1 'int main() { char x; return sizeof(x); }'
 assert 10 'int main() { char x[10]; return sizeof(x); }'
+assert 8 'int main() { long x; return sizeof(x); }'
 assert 1 'int main() { return sub_char(7, 3, 3); } int sub_char(char a, char b, char c) { return a-b-c; }'
 
 # step25 文字列リテラル
@@ -226,4 +256,26 @@ assert 2 'int main() { int x=2; { int x=3; } return x; }'
 assert 2 'int main() { int x=2; { int x=3; } { int y=4; return x; }}'
 assert 3 'int main() { int x=2; { x=3; } return x; }'
 
+# 末尾呼び出し. 自分自身への末尾呼び出しはループになるのでスタックが伸びない
+assert 100 'int down(int n, int acc) { if (n==0) return acc; return down(n-1, acc+1); } int main() { return down(10000000, 0) - 9999900; }'
+assert 100 'int down(int n, int acc) { if (n==0) return acc; return down(n-1, acc+1); } int main() { return down(10000000, 0) - 9999900; }' -fir
+assert 21 'int swap(int a, int b, int n) { if (n==0) return a*10+b; return swap(b, a, n-1); } int main() { return swap(1, 2, 3); }' -fir
+assert 8 'int add3(int x, int y, int z) { return add(x, y) + z; } int f(int x) { return add3(x, 2, 3); } int main() { return f(3); }'
+assert 7 'int main() { return ({ int x=add(3, 4); return add(x, 0); 0; }); }'
+assert 0 'int bad; int f(int n) { return n + ({ if (n==0) return bad; bad = bad + 1 - aligned(); return f(n-1); 0; }); } int main() { return f(10); }' -fno-regalloc
+assert 1 'long f() { return neg1(); } int main() { return f() == -1; }' -fno-inline
+
+# インライン展開した変数は引数の評価中から生きているので, 引数の中の変数と領域を共有しない
+assert 7 'int cube_sub(int x, int y) { return x*x*x - y; } int main() { return cube_sub(({ int a=2; a; }), ({ { int b=3; b; } { int d=4; d; } int c=1; c; })); }' -fno-mem2reg
+
+# ブロックごとの変数やインライン展開した変数は領域を共有するので,
+# testsのmainのフレームは小さく収まる
+./poacc -o tmp.s tests
+frame=$(grep -A4 '^main:' tmp.s | grep -o 'sub rsp, [0-9]*' | grep -o '[0-9]*$')
+if [ "$frame" -gt 96 ]; then
+  echo "frame of main in tests => 96 or less expected, but got $frame"
+  exit 1
+fi
+echo "frame of main in tests => $frame"
+
 echo OK
@@ -12,7 +12,7 @@ char *user_input;
 Token *token;
 
 // errorを報告
-void error(char *fmt, ...) {
+noreturn void error(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
   vfprintf(stderr, fmt, ap);
@@ -24,7 +24,7 @@ void error(char *fmt, ...) {
 //
 // foo.c:10: x = y + 1;
 //               ^ <error message here>
-void verror_at(char *loc, char *fmt, va_list ap) {
+noreturn void verror_at(char *loc, char *fmt, va_list ap) {
   // Find a line containing `loc`.
   char *line = loc;
   while (user_input < line && line[-1] != '\n')
@@ -49,13 +49,13 @@ void verror_at(char *loc, char *fmt, va_list ap) {
   exit(1);
 }
 
-void error_at(char *loc, char *fmt, ...) {
+noreturn void error_at(char *loc, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
   verror_at(loc, fmt, ap);
 }
 
-void error_tok(Token *tok, char *fmt, ...) {
+noreturn void error_tok(Token *tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
   if (tok)
@@ -66,6 +66,20 @@ void error_tok(Token *tok, char *fmt, ...) {
   exit(1);
 }
 
+// printfと同じ書式で新しい文字列を作る
+char *format(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  char *buf = malloc(len + 1);
+  va_start(ap, fmt);
+  vsnprintf(buf, len + 1, fmt, ap);
+  va_end(ap);
+  return buf;
+}
+
 char *strndupl(char *p, int len) {
   char *buf = malloc(len + 1);
   strncpy(buf, p, len);
@@ -118,7 +132,7 @@ int expect_number() {
 char *expect_ident() {
   if (token->kind != TK_IDENT)
     error_tok(token, "expected an identifier");
-  char *s = strndupl(token->str, token->len);
+  char *s = token->name;
   token = token->next;
   return s;
 }
@@ -128,7 +142,7 @@ bool at_eof() { return token->kind == TK_EOF; }
 
 // 新しいtokenを作成し, それを`cur`の次のtokenとして追加する
 Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-  Token *tok = calloc(1, sizeof(Token));
+  Token *tok = arena_alloc(&token_arena, sizeof(Token));
   tok->kind = kind;
   tok->str = str;
   tok->len = len;
@@ -147,21 +161,58 @@ bool is_alpha(char c) {
 // `c`がアルファベットか数字かどうか
 bool is_alnum(char c) { return is_alpha(c) || ('0' <= c && c <= '9'); }
 
-char *starts_with_reserved(char *p) {
-  // Keyword
-  static char *kw[] = {"return", "if",  "else", "while",
-                       "for",    "int", "char", "sizeof"};
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++) {
-    int len = strlen(kw[i]);
-    if (startswith(p, kw[i]) && !is_alnum(p[len]))
-      return kw[i];
+// 識別子として読んだ`len`文字がキーワードかどうか.
+// 先頭の文字で候補を絞るので, 比較するのは高々2つ.
+bool is_keyword(char *p, int len) {
+#define KW(s) (len == sizeof(s) - 1 && !memcmp(p, s, len))
+  switch (*p) {
+  case 'c':
+    return KW("char");
+  case 'e':
+    return KW("else");
+  case 'f':
+    return KW("for");
+  case 'i':
+    return KW("if") || KW("int");
+  case 'l':
+    return KW("long");
+  case 'r':
+    return KW("return");
+  case 's':
+    return KW("sizeof");
+  case 'w':
+    return KW("while");
+  }
+  return false;
+#undef KW
+}
+
+// `p`から始まる区切り記号の長さ. 区切り記号でなければ0
+int punct_len(char *p) {
+  switch (*p) {
+  case '=':
+  case '!':
+  case '<':
+  case '>':
+    if (p[1] == '=')
+      return 2;
+    return *p == '!' ? 0 : 1;
+  case '+':
+  case '-':
+  case '*':
+  case '/':
+  case '(':
+  case ')':
+  case ';':
+  case '{':
+  case '}':
+  case ',':
+  case '&':
+  case '[':
+  case ']':
+    return 1;
   }
-  // Multi-letter punctuator
-  static char *ops[] = {"==", "!=", "<=", ">="};
-  for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++)
-    if (startswith(p, ops[i]))
-      return ops[i];
-  return NULL;
+  return 0;
 }
 
 char get_escape_char(char c) {
@@ -208,9 +259,7 @@ Token *read_string_literal(Token *cur, char *start) {
     }
   }
   Token *tok = new_token(TK_STR, cur, start, p - start + 1);
-  tok->contents = malloc(len + 1);
-  memcpy(tok->contents, buf, len);
-  tok->contents[len] = '\0';
+  tok->contents = intern(buf, len);
   tok->cont_len = len + 1;
   return tok;
 }
@@ -245,21 +294,14 @@ Token *tokenize() {
       continue;
     }
 
-    // Keyword or 複数文字
-    char *kw = starts_with_reserved(p);
-    if (kw) {
-      int len = strlen(kw);
+    // 区切り記号
+    int len = punct_len(p);
+    if (len) {
       cur = new_token(TK_RESERVED, cur, p, len);
       p += len;
       continue;
     }
 
-    // 1文字
-    if (strchr("+-*/()<>;={},&[]", *p)) {
-      cur = new_token(TK_RESERVED, cur, p++, 1);
-      continue;
-    }
-
     // String literal
     if (*p == '"') {
       cur = read_string_literal(cur, p);
@@ -267,12 +309,17 @@ Token *tokenize() {
       continue;
     }
 
-    // 識別子
+    // 識別子かキーワード
     if (is_alpha(*p)) {
       char *q = p++;
       while (is_alnum(*p))
         p++;
-      cur = new_token(TK_IDENT, cur, q, p - q);
+      if (is_keyword(q, p - q)) {
+        cur = new_token(TK_RESERVED, cur, q, p - q);
+      } else {
+        cur = new_token(TK_IDENT, cur, q, p - q);
+        cur->name = intern(q, p - q);
+      }
       continue;
     }
 
@@ -3,7 +3,7 @@
 #include <stdlib.h>
 
 Type *new_type(TypeKind kind) {
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(&type_arena, sizeof(Type));
   ty->kind = kind;
   return ty;
 }
@@ -12,6 +12,8 @@ Type *char_type() { return new_type(TY_CHAR); }
 
 Type *int_type() { return new_type(TY_INT); }
 
+Type *long_type() { return new_type(TY_LONG); }
+
 Type *pointer_to(Type *base) {
   Type *ty = new_type(TY_PTR);
   ty->base = base;
@@ -30,6 +32,8 @@ int size_of(Type *ty) {
   case TY_CHAR:
     return 1;
   case TY_INT:
+    return 4;
+  case TY_LONG:
   case TY_PTR:
     return 8;
   default:
@@ -38,6 +42,48 @@ int size_of(Type *ty) {
   }
 }
 
+int align_of(Type *ty) {
+  if (ty->kind == TY_ARRAY)
+    return align_of(ty->base);
+  return size_of(ty);
+}
+
+// ポインタの加減算の右辺に要素の大きさを掛ける
+Node *scale_offset(Node *node, Type *ptr) {
+  Node *size = new_num(size_of(ptr->base), node->tok);
+  size->ty = int_type();
+  Node *mul = new_binary(NODE_MUL, node, size, node->tok);
+  mul->ty = int_type();
+  return mul;
+}
+
+// 整数同士の算術演算の結果の型. どちらかがlongならlong, それ以外はint
+Type *arith_type(Type *lhs, Type *rhs) {
+  if (lhs->kind == TY_LONG || rhs->kind == TY_LONG)
+    return long_type();
+  return int_type();
+}
+
+// 呼び出す関数の戻り値の型. 定義のない関数はintを返すものとする
+Function *typed_fns;
+
+Type *ret_type(char *name) {
+  for (Function *fn = typed_fns; fn; fn = fn->next)
+    if (fn->name == name)
+      return fn->ty;
+  return int_type();
+}
+
+// 代入の左辺や単項&の被演算子になれる式かどうかを確かめる.
+// トークンを解放した後のコード生成でエラー位置を出さずに済むように,
+// ここで検査しておく.
+void check_lvalue(Node *node, bool assign) {
+  if (node->kind != NODE_VAR && node->kind != NODE_DEREF)
+    error_tok(node->tok, "not an lvalue");
+  if (assign && node->ty->kind == TY_ARRAY)
+    error_tok(node->tok, "not an lvalue");
+}
+
 void visit(Node *node) {
   if (!node)
     return;
@@ -55,14 +101,20 @@ void visit(Node *node) {
   switch (node->kind) {
   case NODE_MUL:
   case NODE_DIV:
+    node->ty = arith_type(node->lhs->ty, node->rhs->ty);
+    return;
   case NODE_EQ:
   case NODE_NE:
   case NODE_LT:
   case NODE_LE:
-  case NODE_FUNCALL:
+    node->ty = int_type();
+    return;
   case NODE_NUM:
     node->ty = int_type();
     return;
+  case NODE_FUNCALL:
+    node->ty = ret_type(node->funcname);
+    return;
   case NODE_VAR:
     node->ty = node->var->ty;
     return;
@@ -74,17 +126,29 @@ void visit(Node *node) {
     }
     if (node->rhs->ty->base)
       error_tok(node->tok, "invalid pointer arithmetic operands");
-    node->ty = node->lhs->ty;
+    if (node->lhs->ty->base) {
+      node->ty = node->lhs->ty;
+      node->rhs = scale_offset(node->rhs, node->ty);
+    } else {
+      node->ty = arith_type(node->lhs->ty, node->rhs->ty);
+    }
     return;
   case NODE_SUB:
     if (node->rhs->ty->base)
       error_tok(node->tok, "invalid pointer arithmetic operands");
-    node->ty = node->lhs->ty;
+    if (node->lhs->ty->base) {
+      node->ty = node->lhs->ty;
+      node->rhs = scale_offset(node->rhs, node->ty);
+    } else {
+      node->ty = arith_type(node->lhs->ty, node->rhs->ty);
+    }
     return;
   case NODE_ASSIGN:
+    check_lvalue(node->lhs, true);
     node->ty = node->lhs->ty;
     return;
   case NODE_ADDR:
+    check_lvalue(node->lhs, false);
     if (node->lhs->ty->kind == TY_ARRAY)
       node->ty = pointer_to(node->lhs->ty->base);
     else
@@ -111,6 +175,7 @@ void visit(Node *node) {
   }
 }
 void add_type(Program *prog) {
+  typed_fns = prog->fns;
   for (Function *fn = prog->fns; fn; fn = fn->next)
     for (Node *node = fn->node; node; node = node->next)
       visit(node);